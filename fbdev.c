@@ -0,0 +1,122 @@
+#include "fbdev.h"
+
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static struct
+{
+    unsigned char *mem;
+    size_t size;
+    unsigned int width;
+    unsigned int height;
+    unsigned int line; // bytes per row
+    int fd;
+} fb = {NULL, 0, 0, 0, 0, -1};
+
+static void fbdev_close(void)
+{
+    if (fb.mem)
+    {
+        munmap(fb.mem, fb.size);
+        fb.mem = NULL;
+    }
+    if (fb.fd >= 0)
+    {
+        close(fb.fd);
+        fb.fd = -1;
+    }
+    // nothing left to flush into
+    fb.width = 0;
+    fb.height = 0;
+}
+
+static int fbdev_open(char const *path)
+{
+    struct stat st;
+    fbdev_close();
+    fb.fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fb.fd < 0 || fstat(fb.fd, &st) < 0)
+    {
+        goto fail;
+    }
+    if (S_ISCHR(st.st_mode))
+    {
+        struct fb_var_screeninfo var;
+        struct fb_fix_screeninfo fix;
+        if (ioctl(fb.fd, FBIOGET_VSCREENINFO, &var) < 0 || ioctl(fb.fd, FBIOGET_FSCREENINFO, &fix) < 0 ||
+            var.bits_per_pixel != 1)
+        {
+            goto fail;
+        }
+        fb.width = var.xres;
+        fb.height = var.yres;
+        fb.line = fix.line_length;
+        fb.size = fix.smem_len;
+    }
+    else
+    {
+        // a plain file stands in for a panel of the configured size
+        fb.width = SSD1306_LCDWIDTH;
+        fb.height = SSD1306_LCDHEIGHT;
+        fb.line = (SSD1306_LCDWIDTH + 7) / 8;
+        fb.size = (size_t)fb.line * fb.height;
+        if ((size_t)st.st_size < fb.size && ftruncate(fb.fd, (off_t)fb.size) < 0)
+        {
+            goto fail;
+        }
+    }
+    if (fb.width > SSD1306_LCDWIDTH)
+    {
+        fb.width = SSD1306_LCDWIDTH;
+    }
+    if (fb.height > SSD1306_LCDHEIGHT)
+    {
+        fb.height = SSD1306_LCDHEIGHT;
+    }
+    fb.mem = (unsigned char *)mmap(NULL, fb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fb.fd, 0);
+    if (fb.mem == MAP_FAILED)
+    {
+        fb.mem = NULL;
+        goto fail;
+    }
+    return 0;
+fail:
+    fbdev_close();
+    return ~0;
+}
+
+/* Transpose the dirty page columns into rows of 1bpp pixels, least significant bit first */
+static void fbdev_flush(unsigned char *buf, unsigned char const *lo, unsigned char const *hi)
+{
+    for (unsigned int y = 0; y < fb.height; ++y)
+    {
+        unsigned int p = y / 8, k = y % 8;
+        if (lo[p] > hi[p])
+        {
+            y |= 7;
+            continue;
+        }
+        unsigned char const *src = buf + p * SSD1306_LCDWIDTH;
+        unsigned char *row = fb.mem + y * fb.line;
+        unsigned int end = hi[p] < fb.width ? hi[p] + 1U : fb.width;
+        // whole bytes are rewritten, the columns around the span are current in buf as well
+        for (unsigned int x = lo[p] & ~7U; x < end; x += 8)
+        {
+            unsigned int n = fb.width - x < 8 ? fb.width - x : 8;
+            unsigned char bits = 0;
+            for (unsigned int b = 0; b < n; ++b)
+            {
+                bits |= (unsigned char)(((src[x + b] >> k) & 1U) << b);
+            }
+            row[x / 8] = bits;
+        }
+    }
+}
+
+struct ssd1306_driver const ssd1306_driver_fbdev = {
+    "fbdev", 0, fbdev_open, NULL, NULL, fbdev_flush, fbdev_close,
+};
@@ -0,0 +1,17 @@
+#ifndef YAHBOOM_FBDEV_H
+#define YAHBOOM_FBDEV_H
+
+#include "ssd1306_i2c.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* __cplusplus */
+
+/* Renders into a mmapped 1bpp framebuffer such as the one of the ssd1307fb kernel driver, or a plain file */
+extern struct ssd1306_driver const ssd1306_driver_fbdev;
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* fbdev.h */
@@ -1,15 +1,943 @@
 #include "i2c.h"
+#include "i2c_sim.h"
 
 #include <linux/i2c-dev.h>
 #include <linux/i2c.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#define I2C_PACE_MAX 8000 // unit(us)
+#define I2C_PACE_WIN 32 // successes before the delay decays
+#define I2C_PACE_PROBE 8 // transfers per probe step
+#define I2C_REOPEN_AFTER 8 // failed transactions in a row before the adapter is reopened, doubled each time
+
+static struct i2c_pace
+{
+    struct timespec tick;
+    unsigned int delay;
+    unsigned int floor;
+    unsigned int count;
+} pace[0x80];
+
+/* Written by the thread running transfers, snapshotted by anyone */
+static struct
+{
+    atomic_ulong count;
+    atomic_ulong bytes;
+    atomic_ulong errors;
+    atomic_ulong hist[I2C_STAT_BINS];
+} stat[0x80];
+
+static struct i2c_bus const *bus = &i2c_bus_dev;
+static unsigned char prio[0x80]; // enum i2c_prio
+
+/* unit(us) since tick, in 64 bits as long and time_t are 32 bits on armhf */
+static int64_t i2c_elapsed(struct timespec const *tick)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - tick->tv_sec) * 1000000 + (now.tv_nsec - tick->tv_nsec) / 1000;
+}
+
+static char const *const methods[] = {"rdwr", "write", "smbus"};
+
+static struct
+{
+    unsigned long funcs;
+    int fd;
+    int addr;
+} dev = {0, -1, -1};
+
+/* Transfer method per device and enum i2c_op, chosen by i2c_tune(), I2C_METHOD_RDWR until then */
+static unsigned char method[0x80][2];
+
+static int i2c_dev_open(char const *path)
+{
+    dev.fd = -1;
+    return open(path, O_RDWR);
+}
+
+static int i2c_dev_slave(int fd, unsigned short addr)
+{
+    if (dev.fd != fd || dev.addr != addr)
+    {
+        // fails with EBUSY when a kernel driver owns the address
+        if (ioctl(fd, I2C_SLAVE, (unsigned long)addr) < 0)
+        {
+            return ~0;
+        }
+        dev.fd = fd;
+        dev.addr = addr;
+    }
+    return 0;
+}
+
+static int i2c_dev_rdwr(int fd, struct i2c_msg *msgs, unsigned int nmsgs)
+{
+    struct i2c_rdwr_ioctl_data data;
+    data.msgs = msgs;
+    data.nmsgs = nmsgs;
+    return ioctl(fd, I2C_RDWR, &data);
+}
+
+static int i2c_dev_method(int fd, struct i2c_msg *msgs, unsigned int method)
+{
+    switch (method)
+    {
+    case I2C_METHOD_WRITE:
+        if (i2c_dev_slave(fd, msgs->addr) == 0)
+        {
+            return write(fd, msgs->buf, msgs->len) == msgs->len ? 1 : -1;
+        }
+        break;
+    case I2C_METHOD_SMBUS:
+        if (msgs->len - 1 <= I2C_SMBUS_BLOCK_MAX && i2c_dev_slave(fd, msgs->addr) == 0)
+        {
+            union i2c_smbus_data block;
+            struct i2c_smbus_ioctl_data data;
+            data.read_write = I2C_SMBUS_WRITE;
+            data.command = msgs->buf[0];
+            data.data = &block;
+            if (msgs->len == 2)
+            {
+                data.size = I2C_SMBUS_BYTE_DATA;
+                block.byte = msgs->buf[1];
+            }
+            else
+            {
+                data.size = I2C_SMBUS_I2C_BLOCK_DATA;
+                block.block[0] = (unsigned char)(msgs->len - 1);
+                memcpy(block.block + 1, msgs->buf + 1, msgs->len - 1);
+            }
+            return ioctl(fd, I2C_SMBUS, &data) < 0 ? -1 : 1;
+        }
+        break;
+    default:
+        break;
+    }
+    return i2c_dev_rdwr(fd, msgs, 1);
+}
+
+static int i2c_dev_xfer(int fd, struct i2c_msg *msgs, unsigned int nmsgs)
+{
+    // only lone writes have a choice, reads and batches need repeated starts
+    if (nmsgs == 1 && !(msgs->flags & I2C_M_RD) && msgs->len >= 2)
+    {
+        return i2c_dev_method(fd, msgs, method[msgs->addr & 0x7F][msgs->len > 2 ? I2C_OP_BLOCK : I2C_OP_REG]);
+    }
+    return i2c_dev_rdwr(fd, msgs, nmsgs);
+}
+
+static void i2c_dev_close(int fd)
+{
+    dev.fd = -1;
+    close(fd);
+}
+
+unsigned long i2c_funcs(int fd)
+{
+    dev.funcs = 0;
+    if (bus == &i2c_bus_dev && ioctl(fd, I2C_FUNCS, &dev.funcs) < 0)
+    {
+        dev.funcs = 0;
+    }
+    return dev.funcs;
+}
+
+static int i2c_dev_able(unsigned int op, unsigned int method)
+{
+    switch (method)
+    {
+    case I2C_METHOD_RDWR:
+    case I2C_METHOD_WRITE:
+        return (dev.funcs & I2C_FUNC_I2C) != 0;
+    case I2C_METHOD_SMBUS:
+        return (dev.funcs & (op == I2C_OP_REG ? I2C_FUNC_SMBUS_WRITE_BYTE_DATA : I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) != 0;
+    default:
+        return 0;
+    }
+}
+
+void i2c_tune(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char val, unsigned int ops)
+{
+    if (bus != &i2c_bus_dev)
+    {
+        return;
+    }
+    for (unsigned int op = I2C_OP_REG; op <= I2C_OP_BLOCK; ++op)
+    {
+        if (!(ops & (1U << op)))
+        {
+            continue;
+        }
+        unsigned char msg_buf[1 + 16];
+        struct i2c_msg message;
+        long best = -1;
+
+        memset(msg_buf, val, sizeof(msg_buf));
+        msg_buf[0] = reg_addr;
+        message.addr = dev_addr;
+        message.flags = 0;
+        message.len = op == I2C_OP_REG ? 2 : sizeof(msg_buf);
+        message.buf = msg_buf;
+
+        for (unsigned int m = I2C_METHOD_RDWR; m <= I2C_METHOD_SMBUS; ++m)
+        {
+            if (!i2c_dev_able(op, m))
+            {
+                continue;
+            }
+            struct timespec tick;
+            unsigned int n = 0;
+            clock_gettime(CLOCK_MONOTONIC, &tick);
+            for (; n < 8; ++n)
+            {
+                if (i2c_dev_method(fd, &message, m) < 0)
+                {
+                    break;
+                }
+            }
+            long usec = (long)i2c_elapsed(&tick);
+            if (n == 8 && (best < 0 || usec < best))
+            {
+                method[dev_addr & 0x7F][op] = (unsigned char)m;
+                best = usec;
+            }
+        }
+    }
+}
+
+char const *i2c_method(unsigned char dev_addr, unsigned int op)
+{
+    return methods[method[dev_addr & 0x7F][op & 1]];
+}
+
+struct i2c_bus const i2c_bus_dev = {"dev", i2c_dev_open, i2c_dev_xfer, i2c_dev_close};
+
+struct i2c_bus const *i2c_bus_find(char const *name)
+{
+    static struct i2c_bus const *const buses[] = {&i2c_bus_dev, &i2c_bus_sim};
+    for (unsigned int i = 0; i < sizeof(buses) / sizeof(*buses); ++i)
+    {
+        if (strcasecmp(buses[i]->name, name) == 0)
+        {
+            return buses[i];
+        }
+    }
+    return NULL;
+}
+
+void i2c_bus_use(struct i2c_bus const *ctx)
+{
+    bus = ctx ? ctx : &i2c_bus_dev;
+}
+
+struct i2c_bus const *i2c_bus(void)
+{
+    return bus;
+}
+
+/* Failure handling, driven by the thread running transfers */
+static struct
+{
+    unsigned int max; // retries per transaction
+    unsigned int base; // unit(us) backoff before the first retry
+    unsigned int rand;
+    char path[64];
+    int fd;
+    atomic_ulong retries;
+    atomic_ulong failures;
+    atomic_ulong reopens;
+    atomic_ulong recoveries;
+    atomic_ulong last;
+    atomic_ulong worst;
+} recover = {.max = 3, .base = 500, .rand = 1, .fd = -1};
+
+/* Failure streak of each device, so one that keeps failing neither slows down nor resyncs the others */
+static struct
+{
+    unsigned int streak; // failed transactions in a row
+    unsigned int reopens; // adapter reopens during the streak, each doubles the streak for the next one
+    struct timespec since; // first failure of the streak
+    atomic_uint epoch;
+} fail[0x80];
+
+int i2c_open(char const *path)
+{
+    int fd = bus->open(path);
+    strncpy(recover.path, path, sizeof(recover.path) - 1);
+    recover.fd = fd;
+    return fd;
+}
+
+void i2c_close(int fd)
+{
+    bus->close(fd);
+}
+
+static void i2c_pace_wait(struct i2c_pace *ctx)
+{
+    if (ctx->delay)
+    {
+        int64_t elapsed = i2c_elapsed(&ctx->tick);
+        if (elapsed >= 0 && elapsed < (long)ctx->delay)
+        {
+            usleep(ctx->delay - (unsigned int)elapsed);
+        }
+    }
+}
+
+static void i2c_pace_done(struct i2c_pace *ctx, int ok)
+{
+    clock_gettime(CLOCK_MONOTONIC, &ctx->tick);
+    if (ok)
+    {
+        // decay slowly back towards the floor after a run of clean transfers
+        if (ctx->delay > ctx->floor && ++ctx->count >= I2C_PACE_WIN)
+        {
+            ctx->delay -= (ctx->delay - ctx->floor + 3) / 4;
+            ctx->count = 0;
+        }
+    }
+    else
+    {
+        // back off quickly on NAK or bus errors
+        ctx->delay = ctx->delay ? ctx->delay * 2 : 100;
+        if (ctx->delay > I2C_PACE_MAX)
+        {
+            ctx->delay = I2C_PACE_MAX;
+        }
+        ctx->count = 0;
+    }
+}
+
+static void i2c_stat_add(unsigned int addr, unsigned long bytes, int ok, long usec)
+{
+    unsigned int bin = 0;
+    while (usec > 1 && bin < I2C_STAT_BINS - 1)
+    {
+        usec >>= 1;
+        ++bin;
+    }
+    atomic_fetch_add_explicit(&stat[addr].count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat[addr].bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat[addr].hist[bin], 1, memory_order_relaxed);
+    if (!ok)
+    {
+        atomic_fetch_add_explicit(&stat[addr].errors, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ Token bucket shared with other users of the bus, refilled and drained by the thread running transfers.
+ Control traffic always passes and may overdraw it; bulk traffic waits until it is positive again.
+*/
+static struct
+{
+    unsigned long rate; // tokens per second, 0 disables the budget
+    unsigned int unit; // enum i2c_budget_unit
+    struct timespec tick;
+    atomic_long tokens;
+    _Atomic int64_t stamp; // unit(us) since tick, when tokens were last refilled
+    _Atomic uint64_t used;
+    atomic_ulong dropped;
+} budget;
+
+static long i2c_budget_tokens(void)
+{
+    int64_t now = i2c_elapsed(&budget.tick);
+    long tokens = atomic_load_explicit(&budget.tokens, memory_order_relaxed);
+    int64_t stamp = atomic_load_explicit(&budget.stamp, memory_order_relaxed);
+    // clamp before converting back, a long idle spell refills more than a long holds
+    double refill = (double)(now - stamp) * (double)budget.rate / 1000000;
+    return tokens + refill < (double)budget.rate ? tokens + (long)refill : (long)budget.rate;
+}
+
+static void i2c_budget_take(unsigned long bytes, long usec)
+{
+    if (budget.rate)
+    {
+        long take = budget.unit == I2C_BUDGET_BUSY ? usec : (long)bytes;
+        long tokens = i2c_budget_tokens();
+        atomic_store_explicit(&budget.stamp, i2c_elapsed(&budget.tick), memory_order_relaxed);
+        atomic_store_explicit(&budget.tokens, tokens - take, memory_order_relaxed);
+        atomic_fetch_add_explicit(&budget.used, (uint64_t)take, memory_order_relaxed);
+    }
+}
+
+/* Time until bulk traffic may go again, unit(us) */
+static long i2c_budget_wait(void)
+{
+    long tokens = budget.rate ? i2c_budget_tokens() : 1;
+    return tokens > 0 ? 0 : 1 + (long)(-tokens * 1000000.0 / budget.rate);
+}
+
+void i2c_budget_init(unsigned long rate, unsigned int unit)
+{
+    budget.rate = rate;
+    budget.unit = unit;
+    if (unit == I2C_BUDGET_BUSY)
+    {
+        budget.rate = (rate > 100 ? 100 : rate) * 10000; // percent to us per second
+    }
+    clock_gettime(CLOCK_MONOTONIC, &budget.tick);
+    atomic_store(&budget.tokens, (long)budget.rate);
+    atomic_store(&budget.stamp, 0);
+    atomic_store(&budget.used, 0);
+    atomic_store(&budget.dropped, 0);
+}
+
+int i2c_budget_ok(unsigned char dev_addr)
+{
+    if (prio[dev_addr & 0x7F] != I2C_PRIO_BULK || i2c_budget_wait() == 0)
+    {
+        return 1;
+    }
+    atomic_fetch_add_explicit(&budget.dropped, 1, memory_order_relaxed);
+    return 0;
+}
+
+void i2c_budget_stat(struct i2c_budget *ctx)
+{
+    ctx->rate = budget.rate;
+    ctx->unit = budget.unit;
+    ctx->tokens = budget.rate ? i2c_budget_tokens() : 0;
+    ctx->used = atomic_load_explicit(&budget.used, memory_order_relaxed);
+    ctx->dropped = atomic_load_explicit(&budget.dropped, memory_order_relaxed);
+    ctx->uptime = (uint64_t)i2c_elapsed(&budget.tick);
+}
+
+/* Capture file, written by the thread running transfers, one write per transaction so a crash keeps the trace */
+static struct
+{
+    int fd;
+    struct timespec tick;
+} cap = {-1, {0, 0}};
+
+int i2c_capture_open(char const *path)
+{
+    struct i2c_cap_head head;
+    i2c_capture_close();
+    cap.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (cap.fd < 0)
+    {
+        return ~0;
+    }
+    memcpy(head.magic, I2C_CAP_MAGIC, sizeof(head.magic));
+    head.version = I2C_CAP_VERSION;
+    head.size = sizeof(struct i2c_cap);
+    if (write(cap.fd, &head, sizeof(head)) != sizeof(head))
+    {
+        i2c_capture_close();
+        return ~0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &cap.tick);
+    return 0;
+}
+
+void i2c_capture_close(void)
+{
+    if (cap.fd >= 0)
+    {
+        close(cap.fd);
+        cap.fd = -1;
+    }
+}
+
+static void i2c_capture(struct i2c_msg *msgs, unsigned int nmsgs, struct timespec const *tick, long usec, int result)
+{
+    static unsigned char const pad[8];
+    struct i2c_cap rec[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct iovec iov[I2C_RDWR_IOCTL_MAX_MSGS * 3];
+    unsigned int n = 0;
+
+    if (nmsgs > I2C_RDWR_IOCTL_MAX_MSGS)
+    {
+        return;
+    }
+    for (unsigned int i = 0; i < nmsgs; ++i)
+    {
+        // time_t is 32 bits on armhf, so widen before scaling to nanoseconds
+        rec[i].nsec = (uint64_t)(tick->tv_sec - cap.tick.tv_sec) * 1000000000ULL +
+                      (uint64_t)((int64_t)tick->tv_nsec - cap.tick.tv_nsec);
+        rec[i].usec = (uint32_t)usec;
+        rec[i].result = result;
+        rec[i].addr = msgs[i].addr;
+        rec[i].flags = msgs[i].flags & I2C_M_RD;
+        rec[i].len = msgs[i].len;
+        rec[i].index = (uint8_t)i;
+        rec[i].count = (uint8_t)nmsgs;
+        if (rec[i].flags && result)
+        {
+            memset(msgs[i].buf, 0, msgs[i].len);
+        }
+        iov[n].iov_base = rec + i;
+        iov[n++].iov_len = sizeof(*rec);
+        iov[n].iov_base = msgs[i].buf;
+        iov[n++].iov_len = msgs[i].len;
+        iov[n].iov_base = (void *)pad;
+        iov[n++].iov_len = I2C_CAP_ALIGN(rec[i].len) - rec[i].len;
+    }
+    if (writev(cap.fd, iov, (int)n) < 0)
+    {
+        i2c_capture_close();
+    }
+}
+
+void i2c_retry_init(unsigned int max, unsigned int base)
+{
+    recover.max = max;
+    recover.base = base;
+}
+
+unsigned int i2c_epoch(unsigned char dev_addr)
+{
+    return atomic_load_explicit(&fail[dev_addr & 0x7F].epoch, memory_order_acquire);
+}
+
+void i2c_recover_stat(struct i2c_recover *ctx)
+{
+    ctx->retries = atomic_load_explicit(&recover.retries, memory_order_relaxed);
+    ctx->failures = atomic_load_explicit(&recover.failures, memory_order_relaxed);
+    ctx->reopens = atomic_load_explicit(&recover.reopens, memory_order_relaxed);
+    ctx->recoveries = atomic_load_explicit(&recover.recoveries, memory_order_relaxed);
+    ctx->last = atomic_load_explicit(&recover.last, memory_order_relaxed);
+    ctx->worst = atomic_load_explicit(&recover.worst, memory_order_relaxed);
+}
+
+/* Sleep base << n, less a random part of up to half, so retries of separate users spread out */
+static void i2c_backoff(unsigned int n)
+{
+    unsigned int delay = recover.base << (n < 8 ? n : 8);
+    recover.rand ^= recover.rand << 13;
+    recover.rand ^= recover.rand >> 17;
+    recover.rand ^= recover.rand << 5;
+    if (delay > 1)
+    {
+        delay -= recover.rand % (delay / 2 + 1);
+    }
+    usleep(delay);
+}
+
+/* Open the adapter again and move it onto fd, so callers keep their descriptor */
+static void i2c_reopen(int fd)
+{
+    if (fd != recover.fd || *recover.path == 0)
+    {
+        return;
+    }
+    int nfd = bus->open(recover.path);
+    if (nfd < 0)
+    {
+        return;
+    }
+    if (nfd != fd)
+    {
+        dup2(nfd, fd);
+        close(nfd);
+    }
+    dev.fd = -1;
+    atomic_fetch_add_explicit(&recover.reopens, 1, memory_order_relaxed);
+}
+
+static void i2c_recover(int fd, unsigned int addr, int ok)
+{
+    if (ok)
+    {
+        if (fail[addr].streak)
+        {
+            unsigned long usec = (unsigned long)i2c_elapsed(&fail[addr].since);
+            atomic_store_explicit(&recover.last, usec, memory_order_relaxed);
+            if (usec > atomic_load_explicit(&recover.worst, memory_order_relaxed))
+            {
+                atomic_store_explicit(&recover.worst, usec, memory_order_relaxed);
+            }
+            atomic_fetch_add_explicit(&recover.recoveries, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&fail[addr].epoch, 1, memory_order_release);
+            fail[addr].streak = 0;
+            fail[addr].reopens = 0;
+        }
+        return;
+    }
+    if (fail[addr].streak++ == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &fail[addr].since);
+        recover.rand ^= (unsigned int)fail[addr].since.tv_nsec;
+    }
+    atomic_fetch_add_explicit(&recover.failures, 1, memory_order_relaxed);
+    if (fail[addr].reopens < 16 && fail[addr].streak == (unsigned int)I2C_REOPEN_AFTER << fail[addr].reopens)
+    {
+        // a device that is gone for good should not cost a reopen every few transfers
+        ++fail[addr].reopens;
+        i2c_reopen(fd);
+    }
+}
+
+static int i2c_exec(int fd, struct i2c_msg *msgs, unsigned int nmsgs)
+{
+    unsigned int addr = msgs->addr & 0x7F;
+    struct i2c_pace *ctx = pace + addr;
+    unsigned long bytes = 0;
+    struct timespec start, tick;
+    int ok = 0, result = 0;
+
+    for (unsigned int i = 0; i < nmsgs; ++i)
+    {
+        bytes += msgs[i].len;
+    }
+    for (unsigned int n = 0;; ++n)
+    {
+        i2c_pace_wait(ctx);
+        clock_gettime(CLOCK_MONOTONIC, &tick);
+        if (n == 0)
+        {
+            start = tick;
+        }
+        ok = bus->xfer(fd, msgs, nmsgs) >= 0;
+        result = ok ? 0 : -errno;
+        long usec = (long)i2c_elapsed(&tick);
+        i2c_pace_done(ctx, ok);
+        i2c_stat_add(addr, bytes, ok, usec);
+        i2c_budget_take(bytes, usec);
+        // once the bus looks down, fail fast instead of stalling every caller
+        if (ok || n >= recover.max || fail[addr].streak >= I2C_REOPEN_AFTER)
+        {
+            break;
+        }
+        atomic_fetch_add_explicit(&recover.retries, 1, memory_order_relaxed);
+        i2c_backoff(n);
+    }
+    if (cap.fd >= 0)
+    {
+        // one record per transaction with its final outcome, so a replay does not repeat the retries
+        i2c_capture(msgs, nmsgs, &start, (long)i2c_elapsed(&start), result);
+    }
+    i2c_recover(fd, addr, ok);
+    return ok ? 0 : ~0;
+}
+
+unsigned int i2c_faults(unsigned char dev_addr)
+{
+    return (unsigned int)atomic_load_explicit(&stat[dev_addr & 0x7F].errors, memory_order_relaxed);
+}
+
+void i2c_stat(unsigned char dev_addr, struct i2c_stat *ctx)
+{
+    unsigned int addr = dev_addr & 0x7F;
+    ctx->count = atomic_load_explicit(&stat[addr].count, memory_order_relaxed);
+    ctx->bytes = atomic_load_explicit(&stat[addr].bytes, memory_order_relaxed);
+    ctx->errors = atomic_load_explicit(&stat[addr].errors, memory_order_relaxed);
+    for (unsigned int i = 0; i < I2C_STAT_BINS; ++i)
+    {
+        ctx->hist[i] = atomic_load_explicit(&stat[addr].hist[i], memory_order_relaxed);
+    }
+}
+
+#define I2C_TXN_MSGS 16
+#define I2C_TXN_DATA 64
+
+struct i2c_txn
+{
+    int fd;
+    unsigned int nmsgs;
+    struct i2c_msg msgs[I2C_TXN_MSGS];
+    unsigned char data[I2C_TXN_DATA];
+    void (*done)(int ok, void *arg);
+    void *arg;
+    struct timespec tick;
+};
+
+/*
+ Single producer (the scheduler thread) and single consumer (the bus thread).
+ The consumer advances tail only after a transaction completes,
+ so head == tail means the bus is idle as well as the ring being empty.
+*/
+struct i2c_ring
+{
+    struct i2c_txn slot[I2C_RING];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_ulong wait; // longest time a transaction sat queued, unit(us)
+};
+
+static struct
+{
+    struct i2c_ring ring[2]; // indexed by enum i2c_prio
+    pthread_t thread;
+    sem_t sem;
+    _Bool run;
+} async;
+
+static int i2c_ring_empty(struct i2c_ring *ctx)
+{
+    return atomic_load_explicit(&ctx->tail, memory_order_acquire) ==
+           atomic_load_explicit(&ctx->head, memory_order_acquire);
+}
+
+static void *i2c_worker(void *arg)
+{
+    for (;;)
+    {
+        while (sem_wait(&async.sem) && errno == EINTR)
+        {
+        }
+        // control transactions overtake queued bulk chunks
+        struct i2c_ring *ctx = async.ring + I2C_PRIO_CONTROL;
+        if (i2c_ring_empty(ctx))
+        {
+            ctx = async.ring + I2C_PRIO_BULK;
+            long wait = i2c_budget_wait();
+            if (wait)
+            {
+                // defer bulk chunks, but keep serving control transactions
+                usleep(wait < 1000 ? (unsigned int)wait : 1000);
+                sem_post(&async.sem);
+                continue;
+            }
+        }
+        size_t tail = atomic_load_explicit(&ctx->tail, memory_order_relaxed);
+        struct i2c_txn *txn = ctx->slot + (tail & (I2C_RING - 1));
+        if (txn->nmsgs == 0)
+        {
+            atomic_store_explicit(&ctx->tail, tail + 1, memory_order_release);
+            break;
+        }
+        unsigned long wait = (unsigned long)i2c_elapsed(&txn->tick);
+        if (wait > atomic_load_explicit(&ctx->wait, memory_order_relaxed))
+        {
+            atomic_store_explicit(&ctx->wait, wait, memory_order_relaxed);
+        }
+        int ok = i2c_exec(txn->fd, txn->msgs, txn->nmsgs) == 0;
+        if (txn->done)
+        {
+            txn->done(ok, txn->arg);
+        }
+        atomic_store_explicit(&ctx->tail, tail + 1, memory_order_release);
+    }
+    return arg;
+}
+
+static struct i2c_txn *i2c_async_slot(struct i2c_ring *ctx)
+{
+    size_t head = atomic_load_explicit(&ctx->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ctx->tail, memory_order_acquire) >= I2C_RING)
+    {
+        usleep(100);
+    }
+    return ctx->slot + (head & (I2C_RING - 1));
+}
+
+static void i2c_async_push(struct i2c_ring *ctx)
+{
+    size_t head = atomic_load_explicit(&ctx->head, memory_order_relaxed);
+    clock_gettime(CLOCK_MONOTONIC, &ctx->slot[head & (I2C_RING - 1)].tick);
+    atomic_store_explicit(&ctx->head, head + 1, memory_order_release);
+    sem_post(&async.sem);
+}
+
+void i2c_prio(unsigned char dev_addr, unsigned int level)
+{
+    prio[dev_addr & 0x7F] = level == I2C_PRIO_BULK ? I2C_PRIO_BULK : I2C_PRIO_CONTROL;
+}
+
+unsigned long i2c_async_wait(unsigned int level)
+{
+    return atomic_load_explicit(&async.ring[level & 1].wait, memory_order_relaxed);
+}
+
+int i2c_async_start(void)
+{
+    if (async.run)
+    {
+        return 0;
+    }
+    if (sem_init(&async.sem, 0, 0))
+    {
+        return ~0;
+    }
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+        atomic_store(&async.ring[i].head, 0);
+        atomic_store(&async.ring[i].tail, 0);
+        atomic_store(&async.ring[i].wait, 0);
+    }
+    // signals go to the scheduler thread, whose handlers stop and join this one
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&async.thread, NULL, i2c_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err)
+    {
+        sem_destroy(&async.sem);
+        return ~0;
+    }
+    async.run = 1;
+    return 0;
+}
+
+void i2c_async_sync(void)
+{
+    if (async.run)
+    {
+        while (!i2c_ring_empty(async.ring + I2C_PRIO_CONTROL) ||
+               !i2c_ring_empty(async.ring + I2C_PRIO_BULK))
+        {
+            usleep(100);
+        }
+    }
+}
+
+void i2c_async_stop(void)
+{
+    if (async.run)
+    {
+        i2c_async_sync();
+        struct i2c_ring *ctx = async.ring + I2C_PRIO_CONTROL;
+        struct i2c_txn *txn = i2c_async_slot(ctx);
+        txn->nmsgs = 0;
+        i2c_async_push(ctx);
+        pthread_join(async.thread, NULL);
+        sem_destroy(&async.sem);
+        async.run = 0;
+    }
+}
+
+int i2c_submit(int fd, struct i2c_msg const *msgs, unsigned int nmsgs, void (*done)(int ok, void *arg), void *arg)
+{
+    if (nmsgs == 0 || nmsgs > I2C_TXN_MSGS)
+    {
+        return ~0;
+    }
+    if (!async.run)
+    {
+        struct i2c_msg copy[I2C_TXN_MSGS];
+        memcpy(copy, msgs, sizeof(*msgs) * nmsgs);
+        int ok = i2c_exec(fd, copy, nmsgs) == 0;
+        if (done)
+        {
+            done(ok, arg);
+        }
+        return ok ? 0 : ~0;
+    }
+    struct i2c_ring *ctx = async.ring + prio[msgs->addr & 0x7F];
+    struct i2c_txn *txn = i2c_async_slot(ctx);
+    txn->fd = fd;
+    txn->nmsgs = nmsgs;
+    memcpy(txn->msgs, msgs, sizeof(*msgs) * nmsgs);
+    txn->done = done;
+    txn->arg = arg;
+    i2c_async_push(ctx);
+    return 0;
+}
+
+int i2c_xfer(int fd, struct i2c_msg *msgs, unsigned int nmsgs)
+{
+    if (!async.run)
+    {
+        return i2c_exec(fd, msgs, nmsgs);
+    }
+    unsigned int size = 0;
+    for (unsigned int i = 0; i < nmsgs; ++i)
+    {
+        if (msgs[i].flags & I2C_M_RD)
+        {
+            size = I2C_TXN_DATA + 1;
+            break;
+        }
+        size += msgs[i].len;
+    }
+    if (nmsgs > I2C_TXN_MSGS || size > I2C_TXN_DATA)
+    {
+        // reads and oversized writes run inline once the bus thread is idle
+        i2c_async_sync();
+        return i2c_exec(fd, msgs, nmsgs);
+    }
+    struct i2c_ring *ctx = async.ring + prio[msgs->addr & 0x7F];
+    struct i2c_txn *txn = i2c_async_slot(ctx);
+    unsigned char *data = txn->data;
+    for (unsigned int i = 0; i < nmsgs; ++i)
+    {
+        txn->msgs[i] = msgs[i];
+        txn->msgs[i].buf = data;
+        memcpy(data, msgs[i].buf, msgs[i].len);
+        data += msgs[i].len;
+    }
+    txn->fd = fd;
+    txn->nmsgs = nmsgs;
+    txn->done = NULL;
+    txn->arg = NULL;
+    i2c_async_push(ctx);
+    return 0;
+}
+
+void i2c_pace_init(unsigned int usec)
+{
+    if (usec > I2C_PACE_MAX)
+    {
+        usec = I2C_PACE_MAX;
+    }
+    for (unsigned int i = 0; i < sizeof(pace) / sizeof(*pace); ++i)
+    {
+        pace[i].delay = usec;
+        pace[i].floor = usec;
+        pace[i].count = 0;
+    }
+}
+
+unsigned int i2c_pace(unsigned char dev_addr)
+{
+    return pace[dev_addr & 0x7F].delay;
+}
+
+unsigned int i2c_pace_probe(int fd, unsigned char dev_addr, struct i2c_reg const *op)
+{
+    static unsigned int const steps[] = {0, 100, 250, 500, 1000, 2000, 4000};
+    struct i2c_pace *ctx = pace + (dev_addr & 0x7F);
+    unsigned int floor = ctx->floor;
+    unsigned int max = recover.max;
+    // a retried transfer would hide the failures the probe is looking for
+    recover.max = 0;
+    for (unsigned int i = 0; i < sizeof(steps) / sizeof(*steps); ++i)
+    {
+        unsigned int err = 0;
+        ctx->delay = steps[i];
+        ctx->floor = steps[i];
+        for (unsigned int n = 0; n < I2C_PACE_PROBE && err == 0; ++n)
+        {
+            unsigned char data_buf;
+            err = op ? i2c_write(fd, dev_addr, op->reg, op->val)
+                     : i2c_read(fd, dev_addr, 0x00, &data_buf);
+            // the adaptive backoff must not leak into the next step
+            ctx->delay = steps[i];
+        }
+        if (err == 0)
+        {
+            recover.max = max;
+            return steps[i];
+        }
+    }
+    // the device never answered cleanly, keep the configured pacing
+    recover.max = max;
+    ctx->delay = floor;
+    ctx->floor = floor;
+    return ~0U;
+}
 
 int i2c_write(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char data_buf)
 {
     unsigned char msg_buf[2];
     struct i2c_msg messages;
-    struct i2c_rdwr_ioctl_data data;
 
     msg_buf[0] = reg_addr;
     msg_buf[1] = data_buf;
@@ -19,21 +947,12 @@ int i2c_write(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned c
     messages.len = 2;
     messages.buf = msg_buf;
 
-    data.msgs = &messages;
-    data.nmsgs = 1;
-    if (ioctl(fd, I2C_RDWR, &data) < 0)
-    {
-        return ~0;
-    }
-
-    usleep(1000);
-    return 0;
+    return i2c_xfer(fd, &messages, 1);
 }
 
 int i2c_read(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char *data_buf)
 {
     struct i2c_msg messages[2];
-    struct i2c_rdwr_ioctl_data data;
 
     messages[0].addr = dev_addr;
     messages[0].flags = 0;
@@ -45,13 +964,77 @@ int i2c_read(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned ch
     messages[1].len = 1;
     messages[1].buf = data_buf;
 
-    data.msgs = messages;
-    data.nmsgs = 2;
-    if (ioctl(fd, I2C_RDWR, &data) < 0)
+    return i2c_xfer(fd, messages, 2);
+}
+
+int i2c_read_burst(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char *data_buf, unsigned int data_len)
+{
+    struct i2c_msg messages[2];
+
+    if (data_len == 0 || data_len > I2C_BLOCK_MAX)
     {
         return ~0;
     }
 
-    usleep(1000);
+    messages[0].addr = dev_addr;
+    messages[0].flags = 0;
+    messages[0].len = 1;
+    messages[0].buf = &reg_addr;
+
+    messages[1].addr = dev_addr;
+    messages[1].flags = I2C_M_RD;
+    messages[1].len = (unsigned short)data_len;
+    messages[1].buf = data_buf;
+
+    return i2c_xfer(fd, messages, 2);
+}
+
+int i2c_write_batch(int fd, unsigned char dev_addr, struct i2c_reg const *ops, unsigned int num)
+{
+    unsigned char msg_buf[I2C_RDWR_IOCTL_MAX_MSGS][2];
+    struct i2c_msg messages[I2C_RDWR_IOCTL_MAX_MSGS];
+
+    while (num)
+    {
+        unsigned int n = num < I2C_RDWR_IOCTL_MAX_MSGS ? num : I2C_RDWR_IOCTL_MAX_MSGS;
+        for (unsigned int i = 0; i < n; ++i)
+        {
+            msg_buf[i][0] = ops[i].reg;
+            msg_buf[i][1] = ops[i].val;
+
+            messages[i].addr = dev_addr;
+            messages[i].flags = 0;
+            messages[i].len = 2;
+            messages[i].buf = msg_buf[i];
+        }
+
+        if (i2c_xfer(fd, messages, n))
+        {
+            return ~0;
+        }
+
+        ops += n;
+        num -= n;
+    }
     return 0;
 }
+
+int i2c_write_block(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char const *data_buf, unsigned int data_len)
+{
+    unsigned char msg_buf[1 + I2C_BLOCK_MAX];
+    struct i2c_msg messages;
+
+    if (data_len > I2C_BLOCK_MAX)
+    {
+        return ~0;
+    }
+    msg_buf[0] = reg_addr;
+    memcpy(msg_buf + 1, data_buf, data_len);
+
+    messages.addr = dev_addr;
+    messages.flags = 0;
+    messages.len = (unsigned short)(1 + data_len);
+    messages.buf = msg_buf;
+
+    return i2c_xfer(fd, &messages, 1);
+}
@@ -1,12 +1,196 @@
 #ifndef YAHBOOM_I2C_H
 #define YAHBOOM_I2C_H
 
+#include <linux/i2c.h>
+#include <stdint.h>
+
+#define I2C_BLOCK_MAX 1024
+
+#define I2C_STAT_BINS 16
+
+/* Per-device counters, hist[n] counts transfers that took [2^n, 2^(n+1)) us */
+struct i2c_stat
+{
+    unsigned long count;
+    unsigned long bytes;
+    unsigned long errors;
+    unsigned long hist[I2C_STAT_BINS];
+};
+
+enum i2c_op
+{
+    I2C_OP_REG, // a lone register write
+    I2C_OP_BLOCK // a lone multi-byte write
+};
+enum i2c_method
+{
+    I2C_METHOD_RDWR, // ioctl(I2C_RDWR)
+    I2C_METHOD_WRITE, // write() after ioctl(I2C_SLAVE)
+    I2C_METHOD_SMBUS // ioctl(I2C_SMBUS), up to I2C_SMBUS_BLOCK_MAX data bytes
+};
+
+enum i2c_prio
+{
+    I2C_PRIO_CONTROL, // short register writes that must not wait
+    I2C_PRIO_BULK // long streams that may be interleaved with control traffic
+};
+
+enum i2c_budget_unit
+{
+    I2C_BUDGET_BYTES, // rate is bytes per second
+    I2C_BUDGET_BUSY // rate is percent of bus time
+};
+
+struct i2c_budget
+{
+    unsigned long rate; // tokens per second, bytes or us of bus time
+    unsigned int unit; // enum i2c_budget_unit
+    long tokens;
+    uint64_t used; // tokens spent since init
+    unsigned long dropped; // bulk transfers refused by i2c_budget_ok()
+    uint64_t uptime; // unit(us) since init
+};
+
+/* How the bus layer rode out failed transfers */
+struct i2c_recover
+{
+    unsigned long retries; // extra attempts after a failed transfer
+    unsigned long failures; // transactions that failed every attempt
+    unsigned long reopens; // times the adapter was closed and opened again
+    unsigned long recoveries; // failure streaks that ended in a success
+    unsigned long last; // unit(us) the last streak lasted
+    unsigned long worst; // unit(us) the longest streak lasted
+};
+
+struct i2c_reg
+{
+    unsigned char reg;
+    unsigned char val;
+};
+
+#define I2C_CAP_MAGIC "YBI2CCAP"
+#define I2C_CAP_VERSION 1
+
+/* Capture file header, followed by records until the end of the file */
+struct i2c_cap_head
+{
+    char magic[8]; // I2C_CAP_MAGIC, not terminated
+    uint32_t version; // I2C_CAP_VERSION
+    uint32_t size; // sizeof(struct i2c_cap)
+};
+
+/*
+ One message of a transaction, followed by len payload bytes padded to 8 bytes.
+ Messages of a transaction are consecutive, index counts up to count - 1.
+ The payload of a read is what came back, zeroed when the transfer failed.
+*/
+struct i2c_cap
+{
+    uint64_t nsec; // CLOCK_MONOTONIC at the start of the transaction, relative to the header
+    uint32_t usec; // duration of the transaction, retries included
+    int32_t result; // 0 or -errno of the transaction
+    uint16_t addr;
+    uint16_t flags; // I2C_M_RD for reads
+    uint16_t len;
+    uint8_t index;
+    uint8_t count;
+};
+
+#define I2C_CAP_ALIGN(len) (((len) + 7U) & ~7U)
+
+/* Bus backend, transfers behave like ioctl(I2C_RDWR) */
+struct i2c_bus
+{
+    char const *name;
+    int (*open)(char const *path);
+    int (*xfer)(int fd, struct i2c_msg *msgs, unsigned int nmsgs);
+    void (*close)(int fd);
+};
+
 #if defined(__cplusplus)
 extern "C" {
 #endif /* __cplusplus */
 
+extern struct i2c_bus const i2c_bus_dev;
+
+struct i2c_bus const *i2c_bus_find(char const *name);
+void i2c_bus_use(struct i2c_bus const *bus);
+struct i2c_bus const *i2c_bus(void);
+int i2c_open(char const *path);
+void i2c_close(int fd);
+
+/* Query and remember the adapter functionality of the "dev" backend */
+unsigned long i2c_funcs(int fd);
+/*
+ Time every method the adapter supports for each enum i2c_op set in the mask ops (1 << op),
+ and keep the fastest that works for dev_addr. The probe writes reg_addr followed by val bytes,
+ one for I2C_OP_REG and a run of them for I2C_OP_BLOCK, so these must be harmless for the device.
+ Devices and ops that are not tuned keep I2C_METHOD_RDWR.
+*/
+void i2c_tune(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char val, unsigned int ops);
+char const *i2c_method(unsigned char dev_addr, unsigned int op);
+
+/* Run a transfer, or queue it on the bus thread when that is running */
+int i2c_xfer(int fd, struct i2c_msg *msgs, unsigned int nmsgs);
 int i2c_write(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char data_buf);
 int i2c_read(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char *data_buf);
+/* Read consecutive registers in one transaction, relying on register auto-increment */
+int i2c_read_burst(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char *data_buf, unsigned int data_len);
+int i2c_write_batch(int fd, unsigned char dev_addr, struct i2c_reg const *ops, unsigned int num);
+int i2c_write_block(int fd, unsigned char dev_addr, unsigned char reg_addr, unsigned char const *data_buf, unsigned int data_len);
+
+/* Count of failed transfers to a device, bumped from whichever thread ran them */
+unsigned int i2c_faults(unsigned char dev_addr);
+void i2c_stat(unsigned char dev_addr, struct i2c_stat *ctx);
+
+/*
+ Move bus traffic to a dedicated thread fed through a lock-free ring.
+ Writes are copied and queued; reads and oversized writes wait for the ring to drain and run inline.
+*/
+int i2c_async_start(void);
+/* Transfers each class can queue before i2c_submit waits for the bus thread, a power of two */
+#define I2C_RING 256
+/* Queue a device's transfers as enum i2c_prio, order is kept within each class */
+void i2c_prio(unsigned char dev_addr, unsigned int prio);
+/* Longest time a transfer of a class sat in the queue, unit(us) */
+unsigned long i2c_async_wait(unsigned int prio);
+void i2c_async_sync(void);
+void i2c_async_stop(void);
+/*
+ Queue a transfer without copying the message buffers, which must stay valid until done runs.
+ done runs on the bus thread with the result and must not submit further transfers.
+*/
+int i2c_submit(int fd, struct i2c_msg const *msgs, unsigned int nmsgs, void (*done)(int ok, void *arg), void *arg);
+
+/* Limit this process's share of a shared bus, rate 0 disables the budget */
+void i2c_budget_init(unsigned long rate, unsigned int unit);
+/* Whether a device may start a bulk transfer now, refusals are counted as dropped */
+int i2c_budget_ok(unsigned char dev_addr);
+void i2c_budget_stat(struct i2c_budget *ctx);
+
+/* Record every transaction that reaches the backend into a capture file */
+int i2c_capture_open(char const *path);
+void i2c_capture_close(void);
+
+/*
+ Retry a failed transfer up to max more times with a jittered exponential backoff from base, unit(us).
+ After a run of failed transactions the adapter is reopened onto the same fd number.
+*/
+void i2c_retry_init(unsigned int max, unsigned int base);
+/* Bumped each time a device answers again after failing, it may have lost its state */
+unsigned int i2c_epoch(unsigned char dev_addr);
+void i2c_recover_stat(struct i2c_recover *ctx);
+
+/* Set the minimum gap between transfers to the same device, unit(us). */
+void i2c_pace_init(unsigned int usec);
+/* Get the gap currently in use for a device, unit(us). */
+unsigned int i2c_pace(unsigned char dev_addr);
+/*
+ Find the smallest gap at which a device answers a burst of transfers cleanly.
+ The burst repeats the register write op, or reads register 0x00 when op is NULL.
+ Returns the chosen gap, or ~0 when the device never answered.
+*/
+unsigned int i2c_pace_probe(int fd, unsigned char dev_addr, struct i2c_reg const *op);
 
 #if defined(__cplusplus)
 } /* extern "C" */
@@ -0,0 +1,347 @@
+#include "i2c_sim.h"
+#include "ssd1306_i2c.h"
+#include "sh1106_i2c.h"
+#include "main.h"
+
+#include <linux/i2c.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+static struct i2c_sim sim;
+
+/* Kept out of sim so that reopening the bus does not rearm it */
+static struct
+{
+    unsigned long at;
+    unsigned long end;
+    unsigned long xfers;
+} glitch;
+
+/* Command bytes still expected by the SSD1306 decoder */
+static struct
+{
+    unsigned char cmd;
+    unsigned char num;
+    unsigned char arg[7];
+    unsigned char len;
+} dec;
+
+static void sim_reset(void)
+{
+    unsigned int latency = sim.latency;
+    _Bool sh1106 = sim.oled.sh1106;
+    memset(&sim, 0, sizeof(sim));
+    memset(&dec, 0, sizeof(dec));
+    sim.latency = latency;
+    sim.oled.sh1106 = sh1106;
+    sim.oled.col_end = 127;
+    sim.oled.page_end = 7;
+    sim.oled.mode = 2;
+    sim.oled.contrast = 0x7F;
+}
+
+static unsigned char sim_args(unsigned char cmd)
+{
+    if (sim.oled.sh1106)
+    {
+        // the SSD1306 addressing and scrolling commands do not exist here
+        switch (cmd)
+        {
+        case SSD1306_SETCONTRAST:
+        case SSD1306_SETDISPLAYOFFSET:
+        case SSD1306_SETCOMPINS:
+        case SSD1306_SETVCOMDETECT:
+        case SSD1306_SETDISPLAYCLOCKDIV:
+        case SSD1306_SETPRECHARGE:
+        case SSD1306_SETMULTIPLEX:
+        case SH1106_DCDC:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+    switch (cmd)
+    {
+    case SSD1306_SETCONTRAST:
+    case SSD1306_SETDISPLAYOFFSET:
+    case SSD1306_SETCOMPINS:
+    case SSD1306_SETVCOMDETECT:
+    case SSD1306_SETDISPLAYCLOCKDIV:
+    case SSD1306_SETPRECHARGE:
+    case SSD1306_SETMULTIPLEX:
+    case SSD1306_MEMORYMODE:
+    case SSD1306_CHARGEPUMP:
+        return 1;
+    case SSD1306_COLUMNADDR:
+    case SSD1306_PAGEADDR:
+    case SSD1306_SET_VERTICAL_SCROLL_AREA:
+        return 2;
+    case SSD1306_VERTICAL_AND_RIGHT_HORIZONTAL_SCROLL:
+    case SSD1306_VERTICAL_AND_LEFT_HORIZONTAL_SCROLL:
+        return 5;
+    case SSD1306_RIGHT_HORIZONTAL_SCROLL:
+    case SSD1306_LEFT_HORIZONTAL_SCROLL:
+        return 6;
+    default:
+        return 0;
+    }
+}
+
+static void sim_command(unsigned char c)
+{
+    if (dec.num)
+    {
+        dec.arg[dec.len++] = c;
+        if (--dec.num)
+        {
+            return;
+        }
+        c = dec.cmd;
+    }
+    else
+    {
+        dec.cmd = c;
+        dec.len = 0;
+        dec.num = sim_args(c);
+        if (dec.num)
+        {
+            return;
+        }
+    }
+    if (sim.oled.sh1106 && c >= SSD1306_MEMORYMODE && c <= SSD1306_ACTIVATE_SCROLL)
+    {
+        return; // not a command of the SH1106
+    }
+    switch (c)
+    {
+    case SSD1306_SETCONTRAST:
+        sim.oled.contrast = dec.arg[0];
+        break;
+    case SSD1306_MEMORYMODE:
+        sim.oled.mode = dec.arg[0] & 3;
+        break;
+    case SSD1306_COLUMNADDR:
+        sim.oled.col_start = dec.arg[0] & 0x7F;
+        sim.oled.col_end = dec.arg[1] & 0x7F;
+        sim.oled.col = sim.oled.col_start;
+        break;
+    case SSD1306_PAGEADDR:
+        sim.oled.page_start = dec.arg[0] & 7;
+        sim.oled.page_end = dec.arg[1] & 7;
+        sim.oled.page = sim.oled.page_start;
+        break;
+    case SSD1306_RIGHT_HORIZONTAL_SCROLL:
+    case SSD1306_LEFT_HORIZONTAL_SCROLL:
+    case SSD1306_VERTICAL_AND_RIGHT_HORIZONTAL_SCROLL:
+    case SSD1306_VERTICAL_AND_LEFT_HORIZONTAL_SCROLL:
+        sim.oled.scroll[0] = c;
+        memcpy(sim.oled.scroll + 1, dec.arg, dec.len);
+        break;
+    case SSD1306_ACTIVATE_SCROLL:
+        sim.oled.scrolling = 1;
+        break;
+    case SSD1306_DEACTIVATE_SCROLL:
+        sim.oled.scrolling = 0;
+        break;
+    case SSD1306_SEGREMAP:
+    case SSD1306_SEGREMAP | 0x1:
+        sim.oled.remap = c & 1;
+        break;
+    case SSD1306_COMSCANINC:
+    case SSD1306_COMSCANDEC:
+        sim.oled.comdec = c == SSD1306_COMSCANDEC;
+        break;
+    case SSD1306_NORMALDISPLAY:
+        sim.oled.invert = 0;
+        break;
+    case SSD1306_INVERTDISPLAY:
+        sim.oled.invert = 1;
+        break;
+    case SSD1306_DISPLAYOFF:
+        sim.oled.on = 0;
+        break;
+    case SSD1306_DISPLAYON:
+        sim.oled.on = 1;
+        break;
+    default:
+        if (c >= 0x40 && c <= 0x7F)
+        {
+            sim.oled.startline = c & 0x3F;
+        }
+        else if (c <= 0x0F)
+        {
+            sim.oled.col = (unsigned char)((sim.oled.col & 0xF0) | c);
+        }
+        else if (c <= 0x1F)
+        {
+            unsigned char high = sim.oled.sh1106 ? 0x0F : 0x07;
+            sim.oled.col = (unsigned char)(((c & high) << 4) | (sim.oled.col & 0x0F));
+        }
+        else if (c >= 0xB0 && c <= 0xB7)
+        {
+            sim.oled.page = c & 7;
+        }
+        break;
+    }
+}
+
+static void sim_data(unsigned char d)
+{
+    if (sim.oled.sh1106)
+    {
+        // page addressing, the column stops at the end of the 132 column RAM
+        if (sim.oled.col < SH1106_COLUMNS)
+        {
+            sim.oled.ram[sim.oled.page & 7][sim.oled.col++] = d;
+        }
+        return;
+    }
+    sim.oled.ram[sim.oled.page & 7][sim.oled.col & 0x7F] = d;
+    switch (sim.oled.mode)
+    {
+    case 0: // horizontal
+        if (sim.oled.col++ >= sim.oled.col_end)
+        {
+            sim.oled.col = sim.oled.col_start;
+            if (sim.oled.page++ >= sim.oled.page_end)
+            {
+                sim.oled.page = sim.oled.page_start;
+            }
+        }
+        break;
+    case 1: // vertical
+        if (sim.oled.page++ >= sim.oled.page_end)
+        {
+            sim.oled.page = sim.oled.page_start;
+            if (sim.oled.col++ >= sim.oled.col_end)
+            {
+                sim.oled.col = sim.oled.col_start;
+            }
+        }
+        break;
+    default: // page
+        if (sim.oled.col < 0x7F)
+        {
+            ++sim.oled.col;
+        }
+        break;
+    }
+}
+
+static int sim_oled(struct i2c_msg const *msg)
+{
+    if (msg->flags & I2C_M_RD)
+    {
+        // status byte: bit 6 is display off
+        memset(msg->buf, sim.oled.on ? 0x00 : 0x40, msg->len);
+        return 0;
+    }
+    for (unsigned int i = 0; i < msg->len;)
+    {
+        unsigned char control = msg->buf[i++];
+        if (control & 0x80) // Co = 1, a single byte follows
+        {
+            if (i < msg->len)
+            {
+                control & 0x40 ? sim_data(msg->buf[i]) : sim_command(msg->buf[i]);
+                ++i;
+            }
+            continue;
+        }
+        for (; i < msg->len; ++i) // Co = 0, the rest is a stream
+        {
+            control & 0x40 ? sim_data(msg->buf[i]) : sim_command(msg->buf[i]);
+        }
+    }
+    return 0;
+}
+
+static int sim_hat(struct i2c_msg const *msg)
+{
+    if (msg->flags & I2C_M_RD)
+    {
+        for (unsigned int i = 0; i < msg->len; ++i)
+        {
+            msg->buf[i] = sim.hat.reg[sim.hat.ptr++];
+        }
+        return 0;
+    }
+    if (msg->len)
+    {
+        sim.hat.ptr = msg->buf[0];
+        for (unsigned int i = 1; i < msg->len; ++i)
+        {
+            sim.hat.reg[sim.hat.ptr++] = msg->buf[i];
+        }
+    }
+    return 0;
+}
+
+static int sim_open(char const *path)
+{
+    (void)(path);
+    sim_reset();
+    return open("/dev/null", O_RDWR);
+}
+
+static int sim_xfer(int fd, struct i2c_msg *msgs, unsigned int nmsgs)
+{
+    (void)(fd);
+    if (sim.latency)
+    {
+        usleep(sim.latency);
+    }
+    ++sim.xfers;
+    if (++glitch.xfers > glitch.at && glitch.xfers <= glitch.end)
+    {
+        errno = EIO;
+        return -1;
+    }
+    for (unsigned int i = 0; i < nmsgs; ++i)
+    {
+        switch (msgs[i].addr)
+        {
+        case HAT_I2C_ADDR:
+            sim_hat(msgs + i);
+            break;
+        case SSD1306_I2C_ADDRESS:
+            sim_oled(msgs + i);
+            break;
+        default:
+            errno = ENXIO;
+            return -1;
+        }
+    }
+    return (int)nmsgs;
+}
+
+static void sim_close(int fd)
+{
+    close(fd);
+}
+
+struct i2c_bus const i2c_bus_sim = {"sim", sim_open, sim_xfer, sim_close};
+
+struct i2c_sim const *i2c_sim(void)
+{
+    return &sim;
+}
+
+void i2c_sim_latency(unsigned int usec)
+{
+    sim.latency = usec;
+}
+
+void i2c_sim_sh1106(_Bool enable)
+{
+    sim.oled.sh1106 = enable;
+}
+
+void i2c_sim_glitch(unsigned long at, unsigned int len)
+{
+    glitch.at = at;
+    glitch.end = at + len;
+    glitch.xfers = 0;
+}
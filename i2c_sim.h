@@ -0,0 +1,51 @@
+#ifndef YAHBOOM_I2C_SIM_H
+#define YAHBOOM_I2C_SIM_H
+
+#include "i2c.h"
+
+/* State of the simulated devices behind the "sim" bus backend */
+struct i2c_sim
+{
+    unsigned long xfers;
+    unsigned int latency; // unit(us) per transaction
+    struct
+    {
+        unsigned char reg[0x100];
+        unsigned char ptr;
+    } hat;
+    struct
+    {
+        unsigned char ram[8][132]; // an SSD1306 uses the first 128 columns
+        unsigned char col, col_start, col_end;
+        unsigned char page, page_start, page_end;
+        unsigned char mode; // 0 horizontal 1 vertical 2 page
+        unsigned char contrast;
+        unsigned char startline;
+        unsigned char scroll[7];
+        _Bool scrolling;
+        _Bool remap; // column 127 is drawn at the left
+        _Bool comdec; // rows scan from the bottom
+        _Bool invert;
+        _Bool on;
+        _Bool sh1106; // page addressing only, 132 columns
+    } oled;
+};
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* __cplusplus */
+
+extern struct i2c_bus const i2c_bus_sim;
+
+struct i2c_sim const *i2c_sim(void);
+void i2c_sim_latency(unsigned int usec);
+/* Model an SH1106 instead of an SSD1306 behind the OLED address, kept across reopens */
+void i2c_sim_sh1106(_Bool enable);
+/* Fail len transactions with EIO after the first at have gone through, counted across reopens */
+void i2c_sim_glitch(unsigned long at, unsigned int len);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* i2c_sim.h */
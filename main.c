@@ -38,9 +38,11 @@
 
 #include "minIni/minIni.h"
 #include "ssd1306_i2c.h"
+#include "sh1106_i2c.h"
 #include "timeslice.h"
 #include "strpool.h"
 #include "main.h"
+#include "i2c_sim.h"
 #include "i2c.h"
 #include "rgb.h"
 
@@ -133,8 +135,14 @@ static struct model
 {
     struct strpool str;
     char const *config;
+    char const *bus;
+    char const *capture;
+    char const *dev;
     void (*term)(int);
     int i2cd;
+    unsigned int epoch; // of the HAT, see i2c_epoch
+#define HAT_PACE_AUTO -1
+    long pace;
     struct
     {
         long temp;
@@ -169,21 +177,31 @@ static struct model
         timeslice_s task;
 #define HAT_OLED_SLEEP_MIN 1
         unsigned int sleep;
+        unsigned int epoch;
         enum oled_scroll scroll;
         _Bool invert;
         _Bool dimmed;
         _Bool enable;
     } oled;
     FILE *log;
+    volatile sig_atomic_t stat;
     uint8_t i2c[3];
+    unsigned int count; // registers for --dump
+    _Bool async;
     _Bool verbose;
     _Bool get;
     _Bool set;
+    _Bool dump;
 } hat = {
     .str = STRPOOL_INIT,
     .config = HAT_CONFIG,
+    .bus = NULL,
+    .capture = NULL,
+    .dev = HAT_DEV_I2C,
     .term = NULL,
     .i2cd = 0,
+    .epoch = 0,
+    .pace = HAT_PACE_AUTO,
     .cpu = {.temp = 0, .idle = 0, .total = 0, .usage = 0},
     .led = {
         .rgb = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}},
@@ -204,12 +222,17 @@ static struct model
         .dimmed = false,
         .enable = true,
         .sleep = HAT_OLED_SLEEP_MIN,
+        .epoch = 0,
     },
     .log = NULL,
+    .stat = 0,
     .i2c = {0, 0, 0},
+    .async = true,
     .verbose = false,
     .get = false,
     .set = false,
+    .dump = false,
+    .count = 1,
 };
 
 static unsigned int byte_parse(uint8_t *ptr, size_t num, char *text)
@@ -495,6 +518,40 @@ static void hat_load_oled(void)
 
     hat.oled.enable = (_Bool)ini_getbool(section, "enable", true, hat.config);
     log_debug("  enable=%u\n", hat.oled.enable);
+
+    long chunk = ini_getl(section, "chunk", 32, hat.config);
+    ssd1306_setChunk(chunk > 0 ? (unsigned int)chunk : 0);
+    log_debug("  chunk=%u\n", ssd1306_getChunk());
+
+    ini_gets(section, "size", "128x32", buffer, sizeof(buffer), hat.config);
+    if (ssd1306_setSize(buffer))
+    {
+        log_error("Unknown OLED size %s, using %s\n", buffer, ssd1306_getSize());
+    }
+    log_debug("  size=%s\n", ssd1306_getSize());
+
+    long rotate = ini_getl(section, "rotate", 0, hat.config);
+    if (rotate % 90)
+    {
+        log_error("OLED rotation %li is not a multiple of 90\n", rotate);
+    }
+    ssd1306_setRotation((unsigned int)(((rotate / 90) % 4 + 4) % 4));
+    log_debug("  rotate=%u\n", ssd1306_getRotation() * 90);
+
+    char fb[PATH_MAX];
+    ini_gets(section, "fb", HAT_DEV_FB, fb, sizeof(fb), hat.config);
+    ini_gets(section, "driver", "ssd1306", buffer, sizeof(buffer), hat.config);
+    if (ssd1306_setDriver(buffer, fb))
+    {
+        log_error("Failed to open OLED driver %s on %s, using ssd1306\n", buffer, fb);
+        ssd1306_setDriver("ssd1306", NULL);
+    }
+    log_debug("  driver=%s\n", ssd1306_getDriver()->name);
+    if (i2c_bus() == &i2c_bus_sim)
+    {
+        i2c_sim_sh1106(ssd1306_getDriver() == &ssd1306_driver_sh1106);
+    }
+    log_debug("  fb=%s\n", fb);
 }
 
 static void hat_load(void)
@@ -620,9 +677,99 @@ hat_config:
         sprintf(buffer, "/dev/i2c-%li", line);
     }
     log_debug("  i2c=%s\n", buffer);
+    {
+        char bus[16];
+        if (hat.bus == NULL)
+        {
+            ini_gets("", "bus", "dev", bus, sizeof(bus), hat.config);
+            hat.bus = bus;
+        }
+        struct i2c_bus const *ctx = i2c_bus_find(hat.bus);
+        if (ctx == NULL)
+        {
+            log_error("Unknown bus: %s\n", hat.bus);
+        }
+        i2c_bus_use(ctx);
+        hat.bus = i2c_bus()->name;
+        log_debug("  bus=%s\n", hat.bus);
+        if (ctx == &i2c_bus_sim)
+        {
+            long latency = ini_getl("", "latency", 0, hat.config);
+            i2c_sim_latency(latency > 0 ? (unsigned int)latency : 0);
+            log_debug("  latency=%u\n", i2c_sim()->latency);
+            char glitch[32];
+            unsigned long at = 0;
+            unsigned int len = 0;
+            ini_gets("", "glitch", "", glitch, sizeof(glitch), hat.config);
+            if (sscanf(glitch, "%lu,%u", &at, &len) == 2)
+            {
+                i2c_sim_glitch(at, len);
+            }
+            log_debug("  glitch=%lu,%u\n", at, len);
+        }
+    }
+    {
+        char path[PATH_MAX];
+        char const *capture = hat.capture;
+        if (capture == NULL)
+        {
+            ini_gets("", "capture", "", path, sizeof(path), hat.config);
+            capture = path;
+        }
+        if (*capture && i2c_capture_open(capture))
+        {
+            log_error("Capture: %s\n", capture);
+        }
+        log_debug("  capture=%s\n", capture);
+    }
+    hat.dev = *strpool_puts(&hat.str, buffer);
     extern int i2cd;
-    i2cd = open(buffer, O_RDWR);
+    i2cd = i2c_open(hat.dev);
     hat.i2cd = i2cd;
+    if (hat.i2cd >= 0)
+    {
+        log_debug("  funcs=0x%08lX\n", i2c_funcs(hat.i2cd));
+    }
+
+    ini_gets("", "pace", "auto", buffer, sizeof(buffer), hat.config);
+    if (isdigit(*buffer))
+    {
+        hat.pace = strtol(buffer, NULL, 0);
+        i2c_pace_init((unsigned int)hat.pace);
+        log_debug("  pace=%li\n", hat.pace);
+    }
+    else
+    {
+        hat.pace = HAT_PACE_AUTO;
+        i2c_pace_init(1000);
+        log_debug("  pace=auto\n");
+    }
+
+    ini_gets("", "budget", "0", buffer, sizeof(buffer), hat.config);
+    {
+        char *endptr;
+        unsigned long rate = strtoul(buffer, &endptr, 0);
+        while (isspace(*endptr))
+        {
+            ++endptr;
+        }
+        unsigned int unit = *endptr == '%' ? I2C_BUDGET_BUSY : I2C_BUDGET_BYTES;
+        i2c_budget_init(rate, unit);
+        log_debug("  budget=%lu%s\n", rate, unit == I2C_BUDGET_BUSY ? "%" : "");
+    }
+
+    {
+        long retry = ini_getl("", "retry", 3, hat.config);
+        long backoff = ini_getl("", "backoff", 500, hat.config);
+        retry = retry > 0 ? retry : 0;
+        backoff = backoff > 0 ? backoff : 0;
+        i2c_retry_init((unsigned int)retry, (unsigned int)backoff);
+        log_debug("  retry=%li\n", retry);
+        log_debug("  backoff=%li\n", backoff);
+    }
+
+    hat.async = (_Bool)ini_getbool("", "async", true, hat.config);
+    log_debug("  async=%u\n", hat.async);
 
     hat_load_led();
     hat_load_fan();
@@ -724,32 +871,8 @@ static int get_ip(char *buffer)
 
 static TIMESLICE_EXEC(exec_fan, );
 static TIMESLICE_EXEC(exec_oled, );
-static void hat_init(void)
+static void hat_oled_begin(void)
 {
-    if (hat.i2cd < 0)
-    {
-        log_error("Failed to initialize I2C!\n");
-        exit(EXIT_FAILURE);
-    }
-    if (hat.get)
-    {
-        i2c_read(hat.i2cd, hat.i2c[0], hat.i2c[1], hat.i2c + 2);
-        printf("0x%02X\n", hat.i2c[2]);
-        exit(EXIT_SUCCESS);
-    }
-    if (hat.set)
-    {
-        i2c_write(hat.i2cd, hat.i2c[0], hat.i2c[1], hat.i2c[2]);
-        exit(EXIT_SUCCESS);
-    }
-    for (unsigned int i = 0; i < 3; ++i)
-    {
-        rgb_set(hat.i2cd, i, hat.led.rgb[i][0], hat.led.rgb[i][1], hat.led.rgb[i][2]);
-    }
-    hat.fan.current_speed = hat.fan.speed;
-    rgb_fan(hat.i2cd, hat.fan.speed);
-    timeslice_cron(&hat.fan.task, exec_fan, 0, hat.fan.sleep);
-    timeslice_join(&hat.fan.task);
     ssd1306_begin(SSD1306_SWITCHCAPVCC);
     switch (hat.oled.scroll)
     {
@@ -778,10 +901,144 @@ static void hat_init(void)
     {
         ssd1306_dim(hat.oled.dimmed);
     }
+}
+
+static void hat_init(void)
+{
+    // the adapter may show up late at boot, wait for it unless this is a one-shot command
+    for (unsigned int wait = 1; hat.i2cd < 0 && !hat.get && !hat.set && !hat.dump && wait <= HAT_OPEN_WAIT; wait <<= 1)
+    {
+        log_error("Failed to open %s, retry in %us\n", hat.dev, wait);
+        fflush(hat.log);
+        sleep(wait);
+        extern int i2cd;
+        i2cd = i2c_open(hat.dev);
+        hat.i2cd = i2cd;
+        if (hat.i2cd >= 0)
+        {
+            log_debug("Funcs: 0x%08lX\n", i2c_funcs(hat.i2cd));
+        }
+    }
+    if (hat.i2cd < 0)
+    {
+        log_error("Failed to initialize I2C!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (hat.get)
+    {
+        i2c_read(hat.i2cd, hat.i2c[0], hat.i2c[1], hat.i2c + 2);
+        printf("0x%02X\n", hat.i2c[2]);
+        exit(EXIT_SUCCESS);
+    }
+    if (hat.dump)
+    {
+        unsigned char reg[0x100];
+        unsigned int start = hat.i2c[1];
+        unsigned int count = hat.count;
+        if (start + count > sizeof(reg))
+        {
+            count = (unsigned int)sizeof(reg) - start;
+        }
+        if (i2c_read_burst(hat.i2cd, hat.i2c[0], (unsigned char)start, reg, count))
+        {
+            log_error("Failed to read 0x%02X from 0x%02X!\n", hat.i2c[0], start);
+            exit(EXIT_FAILURE);
+        }
+        printf("    ");
+        for (unsigned int i = 0; i < 0x10; ++i)
+        {
+            printf(" %2x", i);
+        }
+        for (unsigned int i = start & ~0xFU; i < start + count; ++i)
+        {
+            if ((i & 0xF) == 0)
+            {
+                printf("\n%02x: ", i);
+            }
+            if (i < start)
+            {
+                printf("   ");
+            }
+            else
+            {
+                printf(" %02x", reg[i - start]);
+            }
+        }
+        putchar('\n');
+        exit(EXIT_SUCCESS);
+    }
+    if (hat.set)
+    {
+        i2c_write(hat.i2cd, hat.i2c[0], hat.i2c[1], hat.i2c[2]);
+        exit(EXIT_SUCCESS);
+    }
+    // the kernel owns the panel when it is driven through a framebuffer
+    unsigned char oled = ssd1306_getDriver()->addr;
+    // both are rewritten with what they get next anyway, the fan with its configured speed
+    struct i2c_reg const nop = {0x00, SSD1306_NOP};
+    struct i2c_reg fan;
+    rgb_fan_op(&fan, hat.fan.speed);
+    if (hat.pace == HAT_PACE_AUTO)
+    {
+        if (i2c_pace_probe(hat.i2cd, HAT_I2C_ADDR, &fan) == ~0U)
+        {
+            log_error("Pace: 0x%02X never answered cleanly, keeping %uus\n", HAT_I2C_ADDR, i2c_pace(HAT_I2C_ADDR));
+        }
+        if (oled && i2c_pace_probe(hat.i2cd, oled, &nop) == ~0U)
+        {
+            log_error("Pace: 0x%02X never answered cleanly, keeping %uus\n", oled, i2c_pace(oled));
+        }
+    }
+    // the HAT only ever gets single register writes, and a run of bytes would spill into the next registers
+    i2c_tune(hat.i2cd, HAT_I2C_ADDR, fan.reg, fan.val, 1U << I2C_OP_REG);
+    if (oled)
+    {
+        i2c_tune(hat.i2cd, oled, nop.reg, nop.val, 1U << I2C_OP_REG | 1U << I2C_OP_BLOCK);
+    }
+    log_debug("Method: 0x%02X=%s,%s 0x%02X=%s,%s\n",
+              HAT_I2C_ADDR, i2c_method(HAT_I2C_ADDR, I2C_OP_REG), i2c_method(HAT_I2C_ADDR, I2C_OP_BLOCK),
+              SSD1306_I2C_ADDRESS, i2c_method(SSD1306_I2C_ADDRESS, I2C_OP_REG),
+              i2c_method(SSD1306_I2C_ADDRESS, I2C_OP_BLOCK));
+    log_debug("Pace: 0x%02X=%uus 0x%02X=%uus\n",
+              HAT_I2C_ADDR, i2c_pace(HAT_I2C_ADDR),
+              SSD1306_I2C_ADDRESS, i2c_pace(SSD1306_I2C_ADDRESS));
+    rgb_setv(hat.i2cd, (unsigned char const(*)[3])hat.led.rgb, 3);
+    hat.fan.current_speed = hat.fan.speed;
+    rgb_fan(hat.i2cd, hat.fan.speed);
+    if (hat.async && i2c_async_start())
+    {
+        log_error("Failed to start the I2C thread!\n");
+    }
+    timeslice_cron(&hat.fan.task, exec_fan, 0, hat.fan.sleep);
+    timeslice_join(&hat.fan.task);
+    hat_oled_begin();
     ssd1306_clearDisplay();
     ssd1306_display();
     timeslice_cron(&hat.oled.task, exec_oled, 0, hat.oled.sleep);
     timeslice_join(&hat.oled.task);
+    hat.epoch = i2c_epoch(HAT_I2C_ADDR);
+    hat.oled.epoch = i2c_epoch(ssd1306_getDriver()->addr);
+}
+
+/* A device answers again after failing, it may have been reset meanwhile */
+static void hat_resync(void)
+{
+    unsigned int epoch = i2c_epoch(HAT_I2C_ADDR);
+    if (hat.epoch != epoch)
+    {
+        hat.epoch = epoch;
+        log_debug("Resync: HAT epoch=%u\n", epoch);
+        rgb_invalidate();
+        rgb_setv(hat.i2cd, (unsigned char const(*)[3])hat.led.rgb, 3);
+        rgb_fan(hat.i2cd, hat.fan.current_speed);
+    }
+    epoch = i2c_epoch(ssd1306_getDriver()->addr);
+    if (hat.oled.epoch != epoch)
+    {
+        hat.oled.epoch = epoch;
+        log_debug("Resync: OLED epoch=%u\n", epoch);
+        hat_oled_begin();
+    }
 }
 
 static TIMESLICE_EXEC(exec_fan, argv)
@@ -813,19 +1070,15 @@ static TIMESLICE_EXEC(exec_fan, argv)
             speed = 0;
         }
     }
-    if (speed > 0 || speed != hat.fan.current_speed)
-    {
-        rgb_fan(hat.i2cd, speed);
-    }
+    rgb_fan(hat.i2cd, speed);
+    hat.fan.current_speed = speed;
     if (hat.led.mode == LED_MODE_DISABLE)
     {
         rgb_off(hat.i2cd);
     }
     else
     {
-        rgb_effect(hat.i2cd, hat.led.mode);
-        rgb_speed(hat.i2cd, hat.led.speed);
-        rgb_color(hat.i2cd, hat.led.color);
+        rgb_mode(hat.i2cd, hat.led.mode, hat.led.speed, hat.led.color);
     }
     (void)(argv);
 }
@@ -846,13 +1099,81 @@ static TIMESLICE_EXEC(exec_oled, argv)
         ssd1306_drawText(0, 16, buffer);
         get_ip(buffer);
         ssd1306_drawText(0, 24, buffer);
+        if (ssd1306_canvasHeight() >= 64 && ssd1306_canvasWidth() >= 96)
+        {
+            // upright 128x64 panels have room for a big temperature readout, "NN.NC" is 90 pixels wide
+            sprintf(buffer, "%.1fC", hat.cpu.temp / 1000.F);
+            ssd1306_setTextSize(3);
+            ssd1306_drawText(0, 40, buffer);
+            ssd1306_setTextSize(1);
+        }
         ssd1306_display();
     }
     (void)(argv);
 }
 
+static void hat_stat(void)
+{
+    for (unsigned int addr = 0; addr < 0x80; ++addr)
+    {
+        struct i2c_stat stat;
+        i2c_stat((unsigned char)addr, &stat);
+        if (stat.count == 0)
+        {
+            continue;
+        }
+        log_debug("I2C 0x%02X: xfers=%lu bytes=%lu errors=%lu pace=%uus\n",
+                  addr, stat.count, stat.bytes, stat.errors, i2c_pace((unsigned char)addr));
+        for (unsigned int i = 0; i < I2C_STAT_BINS; ++i)
+        {
+            if (stat.hist[i])
+            {
+                log_debug("  <%luus=%lu\n", 2UL << i, stat.hist[i]);
+            }
+        }
+    }
+    struct i2c_budget budget;
+    i2c_budget_stat(&budget);
+    if (budget.rate)
+    {
+        double allowed = budget.rate * (budget.uptime / 1000000.0);
+        log_debug("Budget: %lu%s used=%llu (%.1f%%) tokens=%li dropped=%lu\n",
+                  budget.rate, budget.unit == I2C_BUDGET_BUSY ? "us/s" : "B/s", (unsigned long long)budget.used,
+                  allowed > 0 ? budget.used * 100 / allowed : 0.0, budget.tokens, budget.dropped);
+    }
+    {
+        struct i2c_recover recover;
+        i2c_recover_stat(&recover);
+        log_debug("Recover: retries=%lu failures=%lu reopens=%lu recoveries=%lu last=%luus worst=%luus\n",
+                  recover.retries, recover.failures, recover.reopens,
+                  recover.recoveries, recover.last, recover.worst);
+    }
+    {
+        struct ssd1306_stat oled;
+        ssd1306_getStat(&oled);
+        log_debug("OLED: frames=%lu skipped=%lu (%.1f%%) deferred=%lu bytes=%lu chunk=%u glyphs=%lu atlas=%lu/%u\n",
+                  oled.frames, oled.skipped, oled.frames ? oled.skipped * 100.0 / oled.frames : 0.0,
+                  oled.deferred, oled.bytes, ssd1306_getChunk(), oled.glyphs, oled.atlas, SSD1306_ATLAS_BYTES);
+    }
+    log_debug("Queue: control<=%luus bulk<=%luus\n",
+              i2c_async_wait(I2C_PRIO_CONTROL), i2c_async_wait(I2C_PRIO_BULK));
+    fflush(hat.log);
+}
+
 static void hat_exit(void)
 {
+    i2c_async_stop();
+    i2c_capture_close();
+    if (hat.verbose)
+    {
+        hat_stat();
+    }
+    if (i2c_bus() == &i2c_bus_sim)
+    {
+        struct i2c_sim const *sim = i2c_sim();
+        log_debug("Sim: xfers=%lu fan=0x%02X contrast=0x%02X invert=%u scroll=%u\n",
+                  sim->xfers, sim->hat.reg[0x08], sim->oled.contrast, sim->oled.invert, sim->oled.scrolling);
+    }
     {
         size_t i = 0;
         log_trace("String: 0x%zX\n", hat.str.num + hat.str.pool.num);
@@ -872,6 +1193,11 @@ static void hat_exit(void)
     }
 }
 
+static void hat_usr1(int sig)
+{
+    hat.stat = sig;
+}
+
 static void hat_term(int sig)
 {
     hat_exit();
@@ -880,16 +1206,20 @@ static void hat_term(int sig)
 
 int main(int argc, char *argv[])
 {
-    char const *shortopts = "c:vh";
+    char const *shortopts = "b:c:vh";
     struct option const longopts[] = {
         {"get", required_argument, 0, 1},
         {"set", required_argument, 0, 2},
+        {"dump", required_argument, 0, 3},
+        {"capture", required_argument, 0, 4},
+        {"bus", required_argument, 0, 'b'},
         {"config", required_argument, 0, 'c'},
         {"verbose", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
     };
 
-    for (int ok; (void)(ok = getopt_long(argc, argv, shortopts, longopts, &optind)), ok != -1;)
+    for (int ok; (void)(ok = getopt_long(argc, argv, shortopts, longopts, NULL)), ok != -1;)
     {
         switch (ok)
         {
@@ -901,6 +1231,32 @@ int main(int argc, char *argv[])
             byte_parse(hat.i2c, sizeof(hat.i2c), optarg);
             hat.set = true;
             break;
+        case 3:
+        {
+            // the count may go past a byte, so only DEV,START go through byte_parse
+            byte_parse(hat.i2c, 2, optarg);
+            char *text = strchr(optarg, ',');
+            text = text ? strchr(text + 1, ',') : NULL;
+            if (text)
+            {
+                char *end;
+                unsigned long count = strtoul(text + 1, &end, 0);
+                if (end == text + 1 || *end || count == 0 || count > 0x100)
+                {
+                    fprintf(stderr, "Invalid count: %s, expected 1 to 256\n", text + 1);
+                    exit(EXIT_FAILURE);
+                }
+                hat.count = (unsigned int)count;
+            }
+            hat.dump = true;
+            break;
+        }
+        case 4:
+            hat.capture = optarg;
+            break;
+        case 'b':
+            hat.bus = optarg;
+            break;
         case 'c':
             hat.config = optarg;
             break;
@@ -914,6 +1270,9 @@ int main(int argc, char *argv[])
             printf("Usage: %s [options]\nOptions:\n", argv[0]);
             puts("      --get DEV,REG     Get the value of the register");
             puts("      --set DEV,REG,VAL Set the value of the register");
+            puts("      --dump DEV,START,COUNT Dump a range of registers");
+            puts("      --capture FILE    Record bus transactions into a file");
+            puts("  -b, --bus NAME        Bus backend: dev sim");
             puts("  -c, --config FILE     Default configuration file: " HAT_CONFIG);
             puts("  -v, --verbose         Display detailed log information");
             puts("  -h, --help            Display available options");
@@ -922,6 +1281,7 @@ int main(int argc, char *argv[])
     }
 
     hat.term = signal(SIGTERM, hat_term);
+    signal(SIGUSR1, hat_usr1);
     atexit(hat_exit);
     hat_load();
 
@@ -929,5 +1289,11 @@ int main(int argc, char *argv[])
     {
         timeslice_tick();
         timeslice_exec();
+        hat_resync();
+        if (hat.stat)
+        {
+            hat.stat = 0;
+            hat_stat();
+        }
     }
 }
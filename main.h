@@ -23,6 +23,8 @@
 #define HAT_CONFIG "yahboom-hat.ini"
 #define HAT_LOG "yahboom-hat.log"
 #define HAT_DEV_I2C "/dev/i2c-0"
+#define HAT_DEV_FB "/dev/fb1"
+#define HAT_OPEN_WAIT 16 // unit(s), longest wait between attempts to open the adapter
 #define HAT_CPU_TEMP "/sys/class/thermal/thermal_zone0/temp"
 #define HAT_CPU_USAGE "/proc/stat"
 #define HAT_DISK_ROOT "/"
@@ -0,0 +1,179 @@
+#include "raster.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define RASTER_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RASTER_NEON
+#endif
+
+#define RASTER_INLINE static inline __attribute__((always_inline))
+
+/*
+ The workhorse behind every operation, inlined with a constant op and with src either NULL for the
+ constant fill or a real buffer, so each caller gets its own branch-free loops.
+*/
+RASTER_INLINE void raster_run(unsigned char *dst, unsigned char const *src, unsigned char fill,
+                              unsigned int n, enum raster_op const op)
+{
+    unsigned int i = 0;
+#if defined(RASTER_SSE2)
+    __m128i const f = _mm_set1_epi8((char)fill);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i d = _mm_loadu_si128((__m128i const *)(dst + i));
+        __m128i s = src ? _mm_loadu_si128((__m128i const *)(src + i)) : f;
+        switch (op)
+        {
+        case RASTER_COPY:
+            d = s;
+            break;
+        case RASTER_OR:
+            d = _mm_or_si128(d, s);
+            break;
+        case RASTER_XOR:
+            d = _mm_xor_si128(d, s);
+            break;
+        case RASTER_CLEAR:
+            d = _mm_andnot_si128(s, d);
+            break;
+        }
+        _mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+#elif defined(RASTER_NEON)
+    uint8x16_t const f = vdupq_n_u8(fill);
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t d = vld1q_u8(dst + i);
+        uint8x16_t s = src ? vld1q_u8(src + i) : f;
+        switch (op)
+        {
+        case RASTER_COPY:
+            d = s;
+            break;
+        case RASTER_OR:
+            d = vorrq_u8(d, s);
+            break;
+        case RASTER_XOR:
+            d = veorq_u8(d, s);
+            break;
+        case RASTER_CLEAR:
+            d = vbicq_u8(d, s);
+            break;
+        }
+        vst1q_u8(dst + i, d);
+    }
+#endif
+    // memcpy keeps unaligned words legal, compilers turn it into plain loads and stores
+    uint64_t const w = 0x0101010101010101ULL * fill;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t d, s = w;
+        memcpy(&d, dst + i, sizeof(d));
+        if (src)
+        {
+            memcpy(&s, src + i, sizeof(s));
+        }
+        switch (op)
+        {
+        case RASTER_COPY:
+            d = s;
+            break;
+        case RASTER_OR:
+            d |= s;
+            break;
+        case RASTER_XOR:
+            d ^= s;
+            break;
+        case RASTER_CLEAR:
+            d &= ~s;
+            break;
+        }
+        memcpy(dst + i, &d, sizeof(d));
+    }
+    for (; i < n; ++i)
+    {
+        unsigned char s = src ? src[i] : fill;
+        switch (op)
+        {
+        case RASTER_COPY:
+            dst[i] = s;
+            break;
+        case RASTER_OR:
+            dst[i] |= s;
+            break;
+        case RASTER_XOR:
+            dst[i] ^= s;
+            break;
+        case RASTER_CLEAR:
+            dst[i] &= (unsigned char)~s;
+            break;
+        }
+    }
+}
+
+void raster_fill(unsigned char *dst, unsigned int n, unsigned char mask, enum raster_op op)
+{
+    switch (op)
+    {
+    case RASTER_COPY:
+        raster_run(dst, NULL, mask, n, RASTER_COPY);
+        break;
+    case RASTER_OR:
+        raster_run(dst, NULL, mask, n, RASTER_OR);
+        break;
+    case RASTER_XOR:
+        raster_run(dst, NULL, mask, n, RASTER_XOR);
+        break;
+    case RASTER_CLEAR:
+        raster_run(dst, NULL, mask, n, RASTER_CLEAR);
+        break;
+    }
+}
+
+void raster_blit(unsigned char *dst, unsigned char const *src, unsigned int n, enum raster_op op)
+{
+    switch (op)
+    {
+    case RASTER_COPY:
+        memmove(dst, src, n);
+        break;
+    case RASTER_OR:
+        raster_run(dst, src, 0, n, RASTER_OR);
+        break;
+    case RASTER_XOR:
+        raster_run(dst, src, 0, n, RASTER_XOR);
+        break;
+    case RASTER_CLEAR:
+        raster_run(dst, src, 0, n, RASTER_CLEAR);
+        break;
+    }
+}
+
+void raster_rect(unsigned char *buf, unsigned int stride, unsigned int x, unsigned int y,
+                 unsigned int w, unsigned int h, enum raster_op op)
+{
+    if (w == 0 || h == 0 || op == RASTER_COPY)
+    {
+        return;
+    }
+    unsigned int last = y + h - 1;
+    for (unsigned int p = y / 8; p <= last / 8; ++p)
+    {
+        // rows y..last that fall into page p
+        unsigned char mask = 0xFF;
+        if (p == y / 8)
+        {
+            mask &= (unsigned char)(0xFF << (y & 7));
+        }
+        if (p == last / 8)
+        {
+            mask &= (unsigned char)(0xFF >> (7 - (last & 7)));
+        }
+        raster_fill(buf + p * stride + x, w, mask, op);
+    }
+}
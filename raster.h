@@ -0,0 +1,36 @@
+#ifndef YAHBOOM_RASTER_H
+#define YAHBOOM_RASTER_H
+
+/*
+ Bulk operations on page-format 1bpp bitmaps, where each byte holds 8 rows of one column.
+ They work a machine word or a SIMD register at a time, SSE2 or NEON when the compiler targets it.
+*/
+enum raster_op
+{
+    RASTER_COPY, // dst = src
+    RASTER_OR, // dst |= src, fills set bits
+    RASTER_XOR, // dst ^= src, inverts set bits
+    RASTER_CLEAR, // dst &= ~src, clears set bits
+};
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* __cplusplus */
+
+/* Combine n bytes at dst with the constant mask */
+void raster_fill(unsigned char *dst, unsigned int n, unsigned char mask, enum raster_op op);
+/* Combine n bytes at dst with n bytes at src */
+void raster_blit(unsigned char *dst, unsigned char const *src, unsigned int n, enum raster_op op);
+/*
+ Fill, invert or clear the pixels of the rectangle at x,y with RASTER_OR, RASTER_XOR or RASTER_CLEAR,
+ the rectangle must lie inside the bitmap, stride is its width. RASTER_COPY would wipe the rows
+ around it in the edge pages, so it does nothing.
+*/
+void raster_rect(unsigned char *buf, unsigned int stride, unsigned int x, unsigned int y,
+                 unsigned int w, unsigned int h, enum raster_op op);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* raster.h */
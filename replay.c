@@ -0,0 +1,283 @@
+/*
+ Replay a bus capture recorded by yahboom-hat --capture
+
+ Copyright (C) 2023 tqfx <tqfx@foxmail.com>
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+
+#include "main.h"
+#include "i2c_sim.h"
+#include "i2c.h"
+
+static struct
+{
+    unsigned long xfers;
+    unsigned long bytes;
+    unsigned long errors;
+    unsigned long results; // transactions whose outcome differs from the capture
+    unsigned long reads; // successful reads whose data differs from the capture
+} count;
+
+/* Read buffers of the transaction being replayed */
+static struct
+{
+    unsigned char *buf;
+    size_t num;
+} scratch;
+
+static unsigned char *replay_scratch(size_t num)
+{
+    if (num > scratch.num)
+    {
+        unsigned char *buf = (unsigned char *)realloc(scratch.buf, num);
+        if (buf == NULL)
+        {
+            return NULL;
+        }
+        scratch.buf = buf;
+        scratch.num = num;
+    }
+    return scratch.buf;
+}
+
+/* Replay the transaction at ptr, return the size it took in the capture or 0 when malformed */
+static size_t replay_txn(int fd, unsigned char const *ptr, size_t num)
+{
+    struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    unsigned char const *data[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct i2c_cap rec;
+    size_t size = 0, rd = 0;
+    unsigned int nmsgs = 0;
+
+    do
+    {
+        if (num - size < sizeof(rec))
+        {
+            return 0;
+        }
+        memcpy(&rec, ptr + size, sizeof(rec));
+        if (rec.index != nmsgs || rec.count > I2C_RDWR_IOCTL_MAX_MSGS ||
+            num - size - sizeof(rec) < I2C_CAP_ALIGN(rec.len))
+        {
+            return 0;
+        }
+        data[nmsgs] = ptr + size + sizeof(rec);
+        msgs[nmsgs].addr = rec.addr;
+        msgs[nmsgs].flags = rec.flags;
+        msgs[nmsgs].len = rec.len;
+        msgs[nmsgs].buf = (unsigned char *)data[nmsgs];
+        if (rec.flags & I2C_M_RD)
+        {
+            rd += rec.len;
+        }
+        size += sizeof(rec) + I2C_CAP_ALIGN(rec.len);
+    } while (++nmsgs < rec.count);
+
+    unsigned char *buf = replay_scratch(rd);
+    if (rd && buf == NULL)
+    {
+        return 0;
+    }
+    for (unsigned int i = 0; i < nmsgs; ++i)
+    {
+        if (msgs[i].flags & I2C_M_RD)
+        {
+            msgs[i].buf = buf;
+            buf += msgs[i].len;
+        }
+        count.bytes += msgs[i].len;
+    }
+
+    int ok = i2c_xfer(fd, msgs, nmsgs) == 0;
+    ++count.xfers;
+    count.errors += !ok;
+    if (ok != (rec.result == 0))
+    {
+        ++count.results;
+    }
+    else if (ok)
+    {
+        for (unsigned int i = 0; i < nmsgs; ++i)
+        {
+            if ((msgs[i].flags & I2C_M_RD) && memcmp(msgs[i].buf, data[i], msgs[i].len))
+            {
+                ++count.reads;
+                break;
+            }
+        }
+    }
+    return size;
+}
+
+static void replay_wait(struct timespec const *start, uint64_t nsec)
+{
+    struct timespec at;
+    nsec += (uint64_t)start->tv_nsec;
+    at.tv_sec = start->tv_sec + (time_t)(nsec / 1000000000);
+    at.tv_nsec = (long)(nsec % 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL))
+    {
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char const *shortopts = "b:i:l:mh";
+    struct option const longopts[] = {
+        {"bus", required_argument, 0, 'b'},
+        {"i2c", required_argument, 0, 'i'},
+        {"latency", required_argument, 0, 'l'},
+        {"max", no_argument, 0, 'm'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    char const *name = "sim";
+    char const *path = HAT_DEV_I2C;
+    unsigned int latency = 0;
+    _Bool max = 0;
+
+    for (int ok; (void)(ok = getopt_long(argc, argv, shortopts, longopts, NULL)), ok != -1;)
+    {
+        switch (ok)
+        {
+        case 'b':
+            name = optarg;
+            break;
+        case 'i':
+            path = optarg;
+            break;
+        case 'l':
+            latency = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            max = 1;
+            break;
+        case '?':
+            exit(EXIT_FAILURE);
+        case 'h':
+        default:
+            printf("Usage: %s [options] FILE\nOptions:\n", argv[0]);
+            puts("  -b, --bus NAME        Bus backend: dev sim, default sim");
+            puts("  -i, --i2c PATH        I2C device for the dev backend: " HAT_DEV_I2C);
+            puts("  -l, --latency USEC    Delay of each simulated transaction, sim only");
+            puts("  -m, --max             Replay at maximum speed instead of the original timing");
+            puts("  -h, --help            Display available options");
+            exit(EXIT_SUCCESS);
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "%s: missing capture file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct i2c_bus const *bus = i2c_bus_find(name);
+    if (bus == NULL)
+    {
+        fprintf(stderr, "Unknown bus: %s\n", name);
+        return EXIT_FAILURE;
+    }
+    i2c_bus_use(bus);
+    i2c_sim_latency(latency);
+
+    int cap = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (cap < 0 || fstat(cap, &st) < 0)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    size_t num = (size_t)st.st_size;
+    struct i2c_cap_head head;
+    if (num < sizeof(head))
+    {
+        fprintf(stderr, "%s: not a capture\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    unsigned char const *ptr = (unsigned char const *)mmap(NULL, num, PROT_READ, MAP_PRIVATE, cap, 0);
+    close(cap);
+    if (ptr == MAP_FAILED)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    memcpy(&head, ptr, sizeof(head));
+    if (memcmp(head.magic, I2C_CAP_MAGIC, sizeof(head.magic)) ||
+        head.version != I2C_CAP_VERSION || head.size != sizeof(struct i2c_cap))
+    {
+        fprintf(stderr, "%s: not a capture of version %u\n", argv[optind], I2C_CAP_VERSION);
+        return EXIT_FAILURE;
+    }
+    madvise((void *)ptr, num, MADV_SEQUENTIAL);
+
+    int fd = i2c_open(path);
+    if (fd < 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    i2c_pace_init(0);
+    // the capture holds each transaction once with its final outcome, retrying here would add attempts
+    i2c_retry_init(0, 0);
+
+    struct timespec start;
+    uint64_t span = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t off = sizeof(head); off < num;)
+    {
+        struct i2c_cap rec;
+        if (num - off >= sizeof(rec))
+        {
+            memcpy(&rec, ptr + off, sizeof(rec));
+            span = rec.nsec + rec.usec * 1000ULL;
+            if (!max)
+            {
+                replay_wait(&start, rec.nsec);
+            }
+        }
+        size_t size = replay_txn(fd, ptr + off, num - off);
+        if (size == 0)
+        {
+            fprintf(stderr, "%s: truncated at 0x%zX\n", argv[optind], off);
+            break;
+        }
+        off += size;
+    }
+    struct timespec stop;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double elapsed = (double)(stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("xfers=%lu bytes=%lu errors=%lu\n", count.xfers, count.bytes, count.errors);
+    printf("mismatch: results=%lu reads=%lu\n", count.results, count.reads);
+    printf("elapsed=%.3fs captured=%.3fs rate=%.0fB/s %.0fxfer/s\n", elapsed, span / 1e9,
+           elapsed > 0 ? count.bytes / elapsed : 0.0, elapsed > 0 ? count.xfers / elapsed : 0.0);
+
+    i2c_close(fd);
+    munmap((void *)ptr, num);
+    free(scratch.buf);
+    return count.results || count.reads ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,23 +2,188 @@
 #include "i2c.h"
 #include "main.h"
 
-void rgb_set(int fd_i2c, unsigned char num, unsigned char R, unsigned char G, unsigned char B)
+#define RGB_MODE 0x70 // 0x04~0x06
+#define RGB_OFF 0x80 // 0x07
+
+/*
+ Write-through shadow of the HAT register file. Registers 0x01~0x03 are a window
+ onto the LED selected by 0x00, so they are cached per LED rather than per address.
+*/
+static struct
+{
+    unsigned char reg[9];
+    unsigned char rgb[3][3];
+    unsigned int valid;
+    unsigned int lit;
+    unsigned int faults;
+} cache = {{0}, {{0}}, 0, 0, 0};
+
+void rgb_invalidate(void)
+{
+    cache.valid = 0;
+    cache.lit = 0;
+}
+
+/* Queued writes report failures late, so drop the cache whenever the fault count moves */
+static void rgb_check(void)
+{
+    unsigned int faults = i2c_faults(HAT_I2C_ADDR);
+    if (cache.faults != faults)
+    {
+        cache.faults = faults;
+        rgb_invalidate();
+    }
+}
+
+static int rgb_cached(unsigned char reg, unsigned char val)
+{
+    rgb_check();
+    return (cache.valid & (1U << reg)) && cache.reg[reg] == val;
+}
+
+static void rgb_write(int fd_i2c, struct i2c_reg const *ops, unsigned int num)
+{
+    if (num == 0)
+    {
+        return;
+    }
+    if (i2c_write_batch(fd_i2c, HAT_I2C_ADDR, ops, num))
+    {
+        // a partial batch may have landed, nothing cached can be trusted
+        rgb_invalidate();
+        return;
+    }
+    for (unsigned int i = 0; i < num; ++i)
+    {
+        unsigned char reg = ops[i].reg;
+        cache.reg[reg] = ops[i].val;
+        cache.valid |= 1U << reg;
+        if (reg <= 0x03)
+        {
+            // static colors override the effect and the off state
+            cache.valid &= ~(RGB_MODE | RGB_OFF);
+        }
+        else if (reg <= 0x06)
+        {
+            cache.valid &= ~RGB_OFF;
+            cache.lit = 0;
+        }
+        else if (reg == 0x07)
+        {
+            cache.valid &= ~RGB_MODE;
+            cache.lit = 0;
+        }
+    }
+}
+
+static unsigned int rgb_ops(struct i2c_reg *ops, unsigned char num, unsigned char R, unsigned char G, unsigned char B)
 {
+    unsigned int mask = 0;
+    rgb_check();
     if (num >= 3)
     {
         num = 0xFF;
+        mask = 7;
     }
-    i2c_write(fd_i2c, HAT_I2C_ADDR, 0x00, num);
-    i2c_write(fd_i2c, HAT_I2C_ADDR, 0x01, R);
-    i2c_write(fd_i2c, HAT_I2C_ADDR, 0x02, G);
-    i2c_write(fd_i2c, HAT_I2C_ADDR, 0x03, B);
+    else
+    {
+        mask = 1U << num;
+    }
+    if ((cache.lit & mask) == mask)
+    {
+        unsigned int i = 0;
+        for (; i < 3; ++i)
+        {
+            if ((mask & (1U << i)) &&
+                (cache.rgb[i][0] != R || cache.rgb[i][1] != G || cache.rgb[i][2] != B))
+            {
+                break;
+            }
+        }
+        if (i == 3)
+        {
+            return 0;
+        }
+    }
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        if (mask & (1U << i))
+        {
+            cache.rgb[i][0] = R;
+            cache.rgb[i][1] = G;
+            cache.rgb[i][2] = B;
+        }
+    }
+    cache.lit |= mask;
+    ops[0].reg = 0x00;
+    ops[0].val = num;
+    ops[1].reg = 0x01;
+    ops[1].val = R;
+    ops[2].reg = 0x02;
+    ops[2].val = G;
+    ops[3].reg = 0x03;
+    ops[3].val = B;
+    return 4;
+}
+
+void rgb_set(int fd_i2c, unsigned char num, unsigned char R, unsigned char G, unsigned char B)
+{
+    struct i2c_reg ops[4];
+    unsigned int n = rgb_ops(ops, num, R, G, B);
+    rgb_write(fd_i2c, ops, n);
+}
+
+void rgb_setv(int fd_i2c, unsigned char const (*rgb)[3], unsigned int num)
+{
+    struct i2c_reg ops[4 * 3];
+    unsigned int n = 0;
+    if (num > 3)
+    {
+        num = 3;
+    }
+    for (unsigned int i = 0; i < num; ++i)
+    {
+        n += rgb_ops(ops + n, (unsigned char)i, rgb[i][0], rgb[i][1], rgb[i][2]);
+    }
+    rgb_write(fd_i2c, ops, n);
+}
+
+static unsigned int rgb_op(struct i2c_reg *ops, unsigned char reg, unsigned char val)
+{
+    if (rgb_cached(reg, val))
+    {
+        return 0;
+    }
+    ops->reg = reg;
+    ops->val = val;
+    return 1;
+}
+
+void rgb_mode(int fd_i2c, unsigned char effect, unsigned char speed, unsigned char color)
+{
+    struct i2c_reg ops[3];
+    unsigned int n = 0;
+    if (effect <= 4)
+    {
+        n += rgb_op(ops + n, 0x04, effect);
+    }
+    if (speed >= 1 && speed <= 3)
+    {
+        n += rgb_op(ops + n, 0x05, speed);
+    }
+    if (color <= 6)
+    {
+        n += rgb_op(ops + n, 0x06, color);
+    }
+    rgb_write(fd_i2c, ops, n);
 }
 
 void rgb_effect(int fd_i2c, unsigned char effect)
 {
     if (effect <= 4)
     {
-        i2c_write(fd_i2c, HAT_I2C_ADDR, 0x04, effect);
+        struct i2c_reg op;
+        rgb_write(fd_i2c, &op, rgb_op(&op, 0x04, effect));
     }
 }
 
@@ -26,7 +191,8 @@ void rgb_speed(int fd_i2c, unsigned char speed)
 {
     if (speed >= 1 && speed <= 3)
     {
-        i2c_write(fd_i2c, HAT_I2C_ADDR, 0x05, speed);
+        struct i2c_reg op;
+        rgb_write(fd_i2c, &op, rgb_op(&op, 0x05, speed));
     }
 }
 
@@ -34,26 +200,34 @@ void rgb_color(int fd_i2c, unsigned char color)
 {
     if (color <= 6)
     {
-        i2c_write(fd_i2c, HAT_I2C_ADDR, 0x06, color);
+        struct i2c_reg op;
+        rgb_write(fd_i2c, &op, rgb_op(&op, 0x06, color));
     }
 }
 
 void rgb_off(int fd_i2c)
 {
-    unsigned char data_buf = 0x00;
-    i2c_write(fd_i2c, HAT_I2C_ADDR, 0x07, data_buf);
+    struct i2c_reg op;
+    rgb_write(fd_i2c, &op, rgb_op(&op, 0x07, 0x00));
 }
 
-void rgb_fan(int fd_i2c, unsigned char speed)
+void rgb_fan_op(struct i2c_reg *op, unsigned char speed)
 {
-    unsigned char data_buf = 0x00;
+    op->reg = 0x08;
+    op->val = 0x00;
     if (speed > 8)
     {
-        data_buf = 1;
+        op->val = 1;
     }
     else if (speed > 0)
     {
-        data_buf = speed + 1;
+        op->val = speed + 1;
     }
-    i2c_write(fd_i2c, HAT_I2C_ADDR, 0x08, data_buf);
+}
+
+void rgb_fan(int fd_i2c, unsigned char speed)
+{
+    struct i2c_reg fan, op;
+    rgb_fan_op(&fan, speed);
+    rgb_write(fd_i2c, &op, rgb_op(&op, fan.reg, fan.val));
 }
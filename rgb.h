@@ -5,10 +5,17 @@
 extern "C" {
 #endif /* __cplusplus */
 
+struct i2c_reg;
+
+void rgb_invalidate(void);
 void rgb_set(int fd_i2c, unsigned char num, unsigned char R, unsigned char G, unsigned char B);
+void rgb_setv(int fd_i2c, unsigned char const (*rgb)[3], unsigned int num);
+void rgb_mode(int fd_i2c, unsigned char effect, unsigned char speed, unsigned char color);
 void rgb_effect(int fd_i2c, unsigned char effect);
 void rgb_speed(int fd_i2c, unsigned char speed);
 void rgb_color(int fd_i2c, unsigned char color);
+/* The register write rgb_fan() sends for speed, without sending it */
+void rgb_fan_op(struct i2c_reg *op, unsigned char speed);
 void rgb_fan(int fd_i2c, unsigned char speed);
 void rgb_off(int fd_i2c);
 
@@ -0,0 +1,75 @@
+#include "sh1106_i2c.h"
+
+#include <stddef.h>
+
+static void sh1106_commands(unsigned char const *c, unsigned int n)
+{
+    // there is no scrolling, and the SSD1306 scroll setups would be taken for other commands
+    switch (c[0])
+    {
+    case SSD1306_RIGHT_HORIZONTAL_SCROLL:
+    case SSD1306_LEFT_HORIZONTAL_SCROLL:
+    case SSD1306_VERTICAL_AND_RIGHT_HORIZONTAL_SCROLL:
+    case SSD1306_VERTICAL_AND_LEFT_HORIZONTAL_SCROLL:
+    case SSD1306_SET_VERTICAL_SCROLL_AREA:
+    case SSD1306_ACTIVATE_SCROLL:
+    case SSD1306_DEACTIVATE_SCROLL:
+        return;
+    default:
+        ssd1306_driver_i2c.commands(c, n);
+    }
+}
+
+static void sh1106_init(unsigned int vccstate)
+{
+    unsigned char const init[] = {
+        SSD1306_DISPLAYOFF, // 0xAE
+        SSD1306_SETDISPLAYCLOCKDIV, // 0xD5
+        0x80, // the suggested ratio 0x80
+        SSD1306_SETMULTIPLEX, // 0xA8
+        SSD1306_LCDHEIGHT - 1,
+        SSD1306_SETDISPLAYOFFSET, // 0xD3
+        0x0, // no offset
+        SSD1306_SETSTARTLINE | 0x0, // line #0
+        SH1106_DCDC, // 0xAD
+        vccstate == SSD1306_EXTERNALVCC ? SH1106_DCDC_OFF : SH1106_DCDC_ON,
+        SSD1306_SEGREMAP | 0x1,
+        SSD1306_COMSCANDEC,
+        SSD1306_SETCOMPINS, // 0xDA
+        SSD1306_LCDHEIGHT == 64 ? 0x12 : 0x02,
+        SSD1306_SETCONTRAST, // 0x81
+        vccstate == SSD1306_EXTERNALVCC ? 0x9F : 0xCF,
+        SSD1306_SETPRECHARGE, // 0xd9
+        vccstate == SSD1306_EXTERNALVCC ? 0x22 : 0x1F,
+        SSD1306_SETVCOMDETECT, // 0xDB
+        0x40,
+        SSD1306_DISPLAYALLON_RESUME, // 0xA4
+        SSD1306_NORMALDISPLAY, // 0xA6
+        SSD1306_DISPLAYON, // --turn on oled panel
+    };
+    ssd1306_driver_i2c.commands(init, sizeof(init));
+}
+
+/* Each dirty page gets its own page and column address followed by the changed span */
+static void sh1106_flush(unsigned char *buf, unsigned char const *lo, unsigned char const *hi)
+{
+    for (unsigned int p = 0; p < SSD1306_LCDHEIGHT / 8; ++p)
+    {
+        if (lo[p] > hi[p])
+        {
+            continue;
+        }
+        unsigned int col = lo[p] + SH1106_OFFSET;
+        unsigned char const page[] = {
+            (unsigned char)(SH1106_SETPAGE | p),
+            (unsigned char)(SSD1306_SETLOWCOLUMN | (col & 0x0F)),
+            (unsigned char)(SSD1306_SETHIGHCOLUMN | (col >> 4)),
+        };
+        ssd1306_stageCommands(page, sizeof(page));
+        ssd1306_stageData(buf + p * SSD1306_LCDWIDTH + lo[p], hi[p] - lo[p] + 1U);
+    }
+}
+
+struct ssd1306_driver const ssd1306_driver_sh1106 = {
+    "sh1106", SSD1306_I2C_ADDRESS, NULL, sh1106_init, sh1106_commands, sh1106_flush, NULL,
+};
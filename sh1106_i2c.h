@@ -0,0 +1,25 @@
+#ifndef YAHBOOM_SH1106_I2C_H
+#define YAHBOOM_SH1106_I2C_H
+
+#include "ssd1306_i2c.h"
+
+#define SH1106_COLUMNS 132 // GDDRAM width, the panel shows the middle SSD1306_LCDWIDTH columns
+#define SH1106_OFFSET ((SH1106_COLUMNS - SSD1306_LCDWIDTH) / 2)
+
+#define SH1106_SETPAGE 0xB0
+#define SH1106_DCDC 0xAD
+#define SH1106_DCDC_ON 0x8B
+#define SH1106_DCDC_OFF 0x8A
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* __cplusplus */
+
+/* SH1106 over I2C, which only has page addressing, written one dirty span per page */
+extern struct ssd1306_driver const ssd1306_driver_sh1106;
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* sh1106_i2c.h */
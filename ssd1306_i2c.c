@@ -29,15 +29,22 @@ redistribution
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #include "ssd1306_i2c.h"
 #include "oled_fonts.h"
+#include "sh1106_i2c.h"
+#include "fbdev.h"
+#include "raster.h"
 #include "i2c.h"
 
 #define true 1
 #define false 0
 
-#define rotation 0
+// quarter turns clockwise, see ssd1306_setRotation
+static unsigned int rotation = 0;
 
 #define pgm_read_byte(addr) (*(const unsigned char *)(addr))
 
@@ -45,7 +52,7 @@ int cursor_y = 0;
 int cursor_x = 0;
 
 // the memory buffer for the LCD. Displays Adafruit logo
-unsigned char buffer[SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8] = {
+unsigned char buffer[SSD1306_FRAME_MAX] = {
     // clang-format off
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -71,7 +78,6 @@ unsigned char buffer[SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x80, 0x80,
     0x80, 0x80, 0x00, 0x80, 0x80, 0x00, 0x00, 0x00,
     0x00, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0xFF,
-#if (SSD1306_LCDHEIGHT * SSD1306_LCDWIDTH > 96 * 16)
     0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x80, 0x80,
     0x80, 0x80, 0x00, 0x00, 0x80, 0x80, 0x00, 0x00,
     0x80, 0xFF, 0xFF, 0x80, 0x80, 0x00, 0x80, 0x80,
@@ -112,7 +118,6 @@ unsigned char buffer[SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8] = {
     0x00, 0x01, 0x03, 0x01, 0x00, 0x00, 0x00, 0x03,
     0x03, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-#if (SSD1306_LCDHEIGHT == 64)
     0x00, 0x00, 0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF9,
     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3F, 0x1F, 0x0F,
     0x87, 0xC7, 0xF7, 0xFF, 0xFF, 0x1F, 0x1F, 0x3D,
@@ -177,208 +182,620 @@ unsigned char buffer[SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-#endif /* SSD1306_LCDHEIGHT */
-#endif /* SSD1306_LCDWIDTH */
     // clang-format on
 };
 
 int _vccstate;
 int i2cd;
 
-#define ssd1306_swap(a, b) \
-    do                     \
-    {                      \
-        __typeof(a) t;     \
-        t = a;             \
-        a = b;             \
-        b = t;             \
-    } while (0)
+#define SSD1306_PAGES_MAX (SSD1306_LCDHEIGHT_MAX / 8)
+// pages of the drawing area, which is taller than the panel when turned by 90 degrees
+#define SSD1306_CANVAS_PAGES (SSD1306_LCDWIDTH_MAX / 8)
+// bus bytes the COLUMNADDR/PAGEADDR setup of one more window is worth
+#define SSD1306_WINDOW_COST 24
 
-// the most basic function, set a single pixel
-void ssd1306_drawPixel(int x, int y, unsigned int color)
+// smallest payload the flush falls back to after errors
+#define SSD1306_CHUNK_MIN 8
+
+// clean frames in a row after which a shrunk chunk doubles again
+#define SSD1306_CHUNK_REGROW 64
+
+// payload bytes per data transfer, shrinks when the adapter rejects long messages
+static unsigned int chunk = SSD1306_FRAME_MAX;
+// the configured chunk, which a shrunk one grows back to
+static unsigned int chunk_set = SSD1306_FRAME_MAX;
+static unsigned int streak = 0; // frames sent cleanly since the chunk last changed
+static unsigned int flushed = false; // whether the last call handed a frame to the bus
+
+/* Drawing kernels specialized for one size of drawing area */
+struct ssd1306_kernels
+{
+    unsigned int width;
+    unsigned int height;
+    void (*pixel)(int x, int y, unsigned int color);
+    void (*hline)(int x, int y, int w, unsigned int color);
+    void (*vline)(int x, int y, int h, unsigned int color);
+    void (*clear)(void);
+};
+
+/* A supported panel size with the kernels specialized for it */
+struct ssd1306_geometry
+{
+    char const *name;
+    unsigned int width;
+    unsigned int height;
+    unsigned int pages;
+    unsigned char compins; // SETCOMPINS argument
+    unsigned char contrast[2]; // SETCONTRAST argument with the charge pump and with external VCC
+    void (*trim)(unsigned char const *back);
+    struct ssd1306_kernels upright; // drawing area as the panel is
+    struct ssd1306_kernels turned; // drawing area turned by 90 degrees
+};
+// the panel in use and the kernels drawing in its rotation, defined along with the kernels below
+static struct ssd1306_geometry const *geo;
+static struct ssd1306_kernels const *canvas;
+
+// columns changed in each page since the last flush, clean when lo > hi
+static struct
+{
+    unsigned char lo[SSD1306_CANVAS_PAGES];
+    unsigned char hi[SSD1306_CANVAS_PAGES];
+} dirty;
+
+// messages of one flush: a window setup per page at most, and the data split into chunks
+#define SSD1306_MSGS (SSD1306_FRAME_MAX / SSD1306_CHUNK_MIN + 2 * SSD1306_PAGES_MAX)
+// a whole frame must fit into the bulk ring, or ssd1306_display would wait for the bus thread
+_Static_assert(SSD1306_MSGS <= I2C_RING, "I2C_RING is too small for a frame");
+
+/*
+ The front buffer holds the last frame handed to the bus, which is what the panel shows once it is sent.
+ Drawing goes to buffer, the back buffer, and ssd1306_display() copies the changed windows over.
+ Data messages point straight into the front buffer: the byte before each chunk is swapped for the
+ 0x40 control byte just before the chunk goes out, and put back once it is sent, on the bus thread.
+ raw[0] is reserved so the first chunk has such a byte too.
+*/
+static struct
 {
-    if ((x < 0) || (x >= WIDTH) || (y < 0) || (y >= HEIGHT))
+    unsigned char raw[1 + SSD1306_FRAME_MAX];
+    unsigned char cmds[SSD1306_PAGES_MAX][1 + SSD1306_STAGE_CMDS]; // window setups behind control byte 0x00
+    struct i2c_msg msgs[SSD1306_MSGS];
+    unsigned char data[SSD1306_MSGS]; // whether a message is a data chunk
+    unsigned int nmsgs;
+    unsigned int ncmds;
+    unsigned char save; // the byte under the control byte in use
+    atomic_uint pending; // messages not sent yet
+    atomic_uint failed;
+} front;
+#define front_buf (front.raw + 1)
+// the drawing area rotated into panel layout, when that is done at flush time
+static unsigned char turned[SSD1306_FRAME_MAX];
+static unsigned int synced; // whether front matches the panel
+static struct ssd1306_stat stat;
+
+static void ssd1306_i2c_init(unsigned int vccstate);
+static void ssd1306_i2c_commands(unsigned char const *c, unsigned int n);
+static void ssd1306_i2c_flush(unsigned char *buf, unsigned char const *lo, unsigned char const *hi);
+
+struct ssd1306_driver const ssd1306_driver_i2c = {
+    "ssd1306", SSD1306_I2C_ADDRESS, NULL, ssd1306_i2c_init, ssd1306_i2c_commands, ssd1306_i2c_flush, NULL,
+};
+
+static struct ssd1306_driver const *driver = &ssd1306_driver_i2c;
+
+static void ssd1306_touch(unsigned int page, unsigned int x0, unsigned int x1)
+{
+    if (dirty.lo[page] > x0)
     {
-        return;
+        dirty.lo[page] = x0;
     }
+    if (dirty.hi[page] < x1)
+    {
+        dirty.hi[page] = x1;
+    }
+}
+
+static void ssd1306_clean(void)
+{
+    memset(dirty.lo, 0xFF, sizeof(dirty.lo));
+    memset(dirty.hi, 0x00, sizeof(dirty.hi));
+}
 
-    // check rotation, move pixel around if necessary
-    switch (rotation)
+void ssd1306_invalidate(void)
+{
+    memset(dirty.lo, 0x00, sizeof(dirty.lo));
+    memset(dirty.hi, geo->width - 1, sizeof(dirty.hi));
+    synced = false;
+}
+
+#define SSD1306_INLINE static inline __attribute__((always_inline))
+
+// Shrink each dirty span to the columns that differ from what the panel already shows
+SSD1306_INLINE void ssd1306_trim(unsigned int const W, unsigned int const H, unsigned char const *back)
+{
+    for (unsigned int p = 0; p < H / 8; ++p)
     {
-    case 1:
-        ssd1306_swap(x, y);
-        x = WIDTH - x - 1;
-        break;
-    case 2:
-        x = WIDTH - x - 1;
-        y = HEIGHT - y - 1;
-        break;
-    case 3:
-        ssd1306_swap(x, y);
-        y = HEIGHT - y - 1;
-        break;
-    default:
-        break;
+        unsigned char const *row = back + p * W;
+        unsigned char const *old = front_buf + p * W;
+        int lo = dirty.lo[p], hi = dirty.hi[p];
+        while (lo <= hi && row[lo] == old[lo])
+        {
+            ++lo;
+        }
+        while (hi > lo && row[hi] == old[hi])
+        {
+            --hi;
+        }
+        if (lo <= hi)
+        {
+            dirty.lo[p] = (unsigned char)lo;
+            dirty.hi[p] = (unsigned char)hi;
+        }
+        else
+        {
+            dirty.lo[p] = 0xFF;
+            dirty.hi[p] = 0x00;
+        }
+    }
+}
+
+void ssd1306_getStat(struct ssd1306_stat *ctx)
+{
+    *ctx = stat;
+}
+
+// the most basic function, set a single pixel
+SSD1306_INLINE void ssd1306_pixel(int const W, int const H, int x, int y, unsigned int color)
+{
+    if ((x < 0) || (x >= W) || (y < 0) || (y >= H))
+    {
+        return;
     }
 
     // x is which column
+    unsigned char *pBuf = buffer + x + (y / 8) * W;
+    unsigned char old = *pBuf;
     switch (color)
     {
     case WHITE:
-        buffer[x + (y / 8) * SSD1306_LCDWIDTH] |= (1 << (y & 7));
+        *pBuf |= (1 << (y & 7));
         break;
     case BLACK:
-        buffer[x + (y / 8) * SSD1306_LCDWIDTH] &= ~(1 << (y & 7));
+        *pBuf &= ~(1 << (y & 7));
         break;
     case INVERSE:
-        buffer[x + (y / 8) * SSD1306_LCDWIDTH] ^= (1 << (y & 7));
+        *pBuf ^= (1 << (y & 7));
         break;
     default:
         break;
     }
+    if (*pBuf != old)
+    {
+        ssd1306_touch(y / 8, x, x);
+    }
 }
 
 // Init SSD1306
 void ssd1306_begin(unsigned int vccstate)
 {
-    // I2C Init
     _vccstate = vccstate;
+    if (driver->addr)
+    {
+        // frame data and the commands around it yield to fan and LED writes
+        i2c_prio(driver->addr, I2C_PRIO_BULK);
+    }
 
-    // Init sequence
-    ssd1306_command(SSD1306_DISPLAYOFF); // 0xAE
-    ssd1306_command(SSD1306_SETDISPLAYCLOCKDIV); // 0xD5
-    ssd1306_command(0x80); // the suggested ratio 0x80
+    // the panel may have been reset, so the next flush sends everything
+    ssd1306_invalidate();
+    if (driver->init)
+    {
+        driver->init(vccstate);
+    }
+    if (rotation == 2 && driver->commands)
+    {
+        // mirroring both axes turns the picture by 180 degrees for free
+        unsigned char const flip[] = {SSD1306_SEGREMAP | 0x0, SSD1306_COMSCANINC};
+        ssd1306_commands(flip, sizeof(flip));
+    }
+}
 
-    ssd1306_command(SSD1306_SETMULTIPLEX); // 0xA8
-    ssd1306_command(SSD1306_LCDHEIGHT - 1);
+static void ssd1306_i2c_init(unsigned int vccstate)
+{
+    // Init sequence
+    unsigned char const init[] = {
+        SSD1306_DISPLAYOFF, // 0xAE
+        SSD1306_SETDISPLAYCLOCKDIV, // 0xD5
+        0x80, // the suggested ratio 0x80
+        SSD1306_SETMULTIPLEX, // 0xA8
+        (unsigned char)(geo->height - 1),
+        SSD1306_SETDISPLAYOFFSET, // 0xD3
+        0x0, // no offset
+        SSD1306_SETSTARTLINE | 0x0, // line #0
+        SSD1306_CHARGEPUMP, // 0x8D
+        vccstate == SSD1306_EXTERNALVCC ? 0x10 : 0x14,
+        SSD1306_MEMORYMODE, // 0x20
+        0x00, // 0x0 act like ks0108
+        SSD1306_SEGREMAP | 0x1,
+        SSD1306_COMSCANDEC,
+        SSD1306_SETCOMPINS, // 0xDA
+        geo->compins,
+        SSD1306_SETCONTRAST, // 0x81
+        geo->contrast[vccstate == SSD1306_EXTERNALVCC],
+        SSD1306_SETPRECHARGE, // 0xd9
+        vccstate == SSD1306_EXTERNALVCC ? 0x22 : 0xF1,
+        SSD1306_SETVCOMDETECT, // 0xDB
+        0x40,
+        SSD1306_DISPLAYALLON_RESUME, // 0xA4
+        SSD1306_NORMALDISPLAY, // 0xA6
+        SSD1306_DEACTIVATE_SCROLL,
+        SSD1306_DISPLAYON, // --turn on oled panel
+    };
+    ssd1306_i2c_commands(init, sizeof(init));
+}
 
-    ssd1306_command(SSD1306_SETDISPLAYOFFSET); // 0xD3
-    ssd1306_command(0x0); // no offset
-    ssd1306_command(SSD1306_SETSTARTLINE | 0x0); // line #0
-    ssd1306_command(SSD1306_CHARGEPUMP); // 0x8D
-    if (vccstate == SSD1306_EXTERNALVCC)
+void ssd1306_invertDisplay(unsigned int i)
+{
+    if (i)
     {
-        ssd1306_command(0x10);
+        ssd1306_command(SSD1306_INVERTDISPLAY);
     }
     else
     {
-        ssd1306_command(0x14);
+        ssd1306_command(SSD1306_NORMALDISPLAY);
     }
-    ssd1306_command(SSD1306_MEMORYMODE); // 0x20
-    ssd1306_command(0x00); // 0x0 act like ks0108
-    ssd1306_command(SSD1306_SEGREMAP | 0x1);
-    ssd1306_command(SSD1306_COMSCANDEC);
+}
 
-#if defined SSD1306_128_32
-    ssd1306_command(SSD1306_SETCOMPINS); // 0xDA
-    ssd1306_command(0x02);
-    ssd1306_command(SSD1306_SETCONTRAST); // 0x81
-    ssd1306_command(0x8F);
+void ssd1306_command(unsigned char c)
+{
+    ssd1306_commands(&c, 1);
+}
 
-#elif defined SSD1306_128_64
-    ssd1306_command(SSD1306_SETCOMPINS); // 0xDA
-    ssd1306_command(0x12);
-    ssd1306_command(SSD1306_SETCONTRAST); // 0x81
-    if (vccstate == SSD1306_EXTERNALVCC)
+void ssd1306_commands(unsigned char const *c, unsigned int n)
+{
+    // a kernel driven panel has no command channel
+    if (driver->commands)
     {
-        ssd1306_command(0x9F);
+        driver->commands(c, n);
     }
-    else
+}
+
+static void ssd1306_i2c_commands(unsigned char const *c, unsigned int n) // I2C
+{
+    // with Co = 0 every byte after the control byte is a command or an argument
+    unsigned char control = 0x00; // Co = 0, D/C = 0
+    i2c_write_block(i2cd, SSD1306_I2C_ADDRESS, control, c, n);
+}
+
+static struct ssd1306_driver const *const drivers[] = {
+    &ssd1306_driver_i2c,
+    &ssd1306_driver_sh1106,
+    &ssd1306_driver_fbdev,
+};
+
+int ssd1306_setDriver(char const *name, char const *path)
+{
+    for (unsigned int i = 0; i < sizeof(drivers) / sizeof(*drivers); ++i)
     {
-        ssd1306_command(0xCF);
+        if (strcasecmp(drivers[i]->name, name) == 0)
+        {
+            if (drivers[i]->open && drivers[i]->open(path))
+            {
+                return ~0;
+            }
+            // a driver opened again has already let go of what it had open
+            if (driver != drivers[i] && driver->close)
+            {
+                driver->close();
+            }
+            driver = drivers[i];
+            ssd1306_invalidate();
+            return 0;
+        }
     }
+    return ~0;
+}
 
-#elif defined SSD1306_96_16
-    ssd1306_command(SSD1306_SETCOMPINS); // 0xDA
-    ssd1306_command(0x2); // ada x12
-    ssd1306_command(SSD1306_SETCONTRAST); // 0x81
-    if (vccstate == SSD1306_EXTERNALVCC)
+struct ssd1306_driver const *ssd1306_getDriver(void) { return driver; }
+
+void ssd1306_setChunk(unsigned int n)
+{
+    chunk = n == 0 || n > SSD1306_FRAME_MAX ? SSD1306_FRAME_MAX : n;
+    // front.msgs only has room for a frame split into chunks of at least SSD1306_CHUNK_MIN
+    if (chunk < SSD1306_CHUNK_MIN)
     {
-        ssd1306_command(0x10);
+        chunk = SSD1306_CHUNK_MIN;
     }
-    else
+    chunk_set = chunk;
+    streak = 0;
+}
+
+unsigned int ssd1306_getChunk(void)
+{
+    unsigned int frame = geo->width * geo->pages;
+    return chunk < frame ? chunk : frame;
+}
+
+static void ssd1306_queue(unsigned char *msg_buf, unsigned int len, unsigned char data)
+{
+    if (front.nmsgs == SSD1306_MSGS)
     {
-        ssd1306_command(0xAF);
+        // a frame the drivers cannot stage, resend it all next time rather than leave the panel stale
+        atomic_store_explicit(&front.failed, true, memory_order_relaxed);
+        return;
     }
+    front.msgs[front.nmsgs].addr = driver->addr;
+    front.msgs[front.nmsgs].flags = 0;
+    front.msgs[front.nmsgs].len = (unsigned short)len;
+    front.msgs[front.nmsgs].buf = msg_buf;
+    front.data[front.nmsgs] = data;
+    ++front.nmsgs;
+}
 
-#endif
-    ssd1306_command(SSD1306_SETPRECHARGE); // 0xd9
-    if (vccstate == SSD1306_EXTERNALVCC)
+// Put the control byte in front of the next data chunk after message i
+static void ssd1306_prefix(unsigned int i)
+{
+    while (i < front.nmsgs && !front.data[i])
     {
-        ssd1306_command(0x22);
+        ++i;
     }
-    else
+    if (i < front.nmsgs)
     {
-        ssd1306_command(0xF1);
+        front.save = front.msgs[i].buf[0];
+        front.msgs[i].buf[0] = 0x40;
     }
-    ssd1306_command(SSD1306_SETVCOMDETECT); // 0xDB
-    ssd1306_command(0x40);
-    ssd1306_command(SSD1306_DISPLAYALLON_RESUME); // 0xA4
-    ssd1306_command(SSD1306_NORMALDISPLAY); // 0xA6
+}
 
-    ssd1306_command(SSD1306_DEACTIVATE_SCROLL);
+void ssd1306_stageCommands(unsigned char const *c, unsigned int n)
+{
+    if (front.ncmds == SSD1306_PAGES_MAX)
+    {
+        atomic_store_explicit(&front.failed, true, memory_order_relaxed);
+        return;
+    }
+    unsigned char *cmds = front.cmds[front.ncmds++];
+    cmds[0] = 0x00;
+    memcpy(cmds + 1, c, n);
+    ssd1306_queue(cmds, n + 1, false);
+}
 
-    ssd1306_command(SSD1306_DISPLAYON); // --turn on oled panel
+void ssd1306_stageData(unsigned char *data, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; i += chunk)
+    {
+        unsigned int left = n - i;
+        // the message starts on the byte before the chunk, which becomes the control byte
+        ssd1306_queue(data + i - 1, 1 + (left < chunk ? left : chunk), true);
+    }
 }
 
-void ssd1306_invertDisplay(unsigned int i)
+// Stage columns x0..x1 of pages p0..p1 of the front buffer behind one COLUMNADDR/PAGEADDR window
+static void ssd1306_window(unsigned int x0, unsigned int x1, unsigned int p0, unsigned int p1)
 {
-    if (i)
+    unsigned char const window[] = {
+        SSD1306_COLUMNADDR, (unsigned char)x0, (unsigned char)x1,
+        SSD1306_PAGEADDR, (unsigned char)p0, (unsigned char)p1,
+    };
+    ssd1306_stageCommands(window, sizeof(window));
+
+    // full-width windows are contiguous in the buffer, narrower ones go row by row
+    unsigned int width = x1 - x0 + 1;
+    unsigned int rows = p1 - p0 + 1;
+    if (width == geo->width)
     {
-        ssd1306_command(SSD1306_INVERTDISPLAY);
+        width *= rows;
+        rows = 1;
     }
-    else
+    for (unsigned int r = 0; r < rows; ++r)
     {
-        ssd1306_command(SSD1306_NORMALDISPLAY);
+        ssd1306_stageData(front_buf + (p0 + r) * geo->width + x0, width);
     }
 }
 
-void ssd1306_command(unsigned char c) // I2C
+// runs on the bus thread
+static void ssd1306_sent(int ok, void *arg)
 {
-    unsigned char control = 0x00; // Co = 0, D/C = 0
-    i2c_write(i2cd, SSD1306_I2C_ADDRESS, control, c);
+    unsigned int i = (unsigned int)(uintptr_t)arg;
+    if (front.data[i])
+    {
+        front.msgs[i].buf[0] = front.save;
+        ssd1306_prefix(i + 1);
+    }
+    if (!ok)
+    {
+        atomic_store_explicit(&front.failed, true, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&front.pending, 1, memory_order_release);
 }
 
-#include <linux/i2c-dev.h>
-#include <linux/i2c.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
-
-void ssd1306_display(void)
+// Transpose the 8x8 block of pixels in[0..7], so bit b of out[k] is bit k of in[b]
+static void ssd1306_transpose(unsigned char const *in, unsigned char *out)
 {
-    ssd1306_command(SSD1306_COLUMNADDR);
-    ssd1306_command(0); // Column start address (0 = reset)
-    ssd1306_command(SSD1306_LCDWIDTH - 1); // Column end address (127 = reset)
+    uint64_t x = 0;
+    for (unsigned int k = 0; k < 8; ++k)
+    {
+        x |= (uint64_t)in[k] << (8 * k);
+    }
+    // swap the off-diagonal 1x1, 2x2 and 4x4 blocks
+    uint64_t t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x ^= t ^ (t << 28);
+    for (unsigned int k = 0; k < 8; ++k)
+    {
+        out[k] = (unsigned char)(x >> (8 * k));
+    }
+}
 
-    ssd1306_command(SSD1306_PAGEADDR);
-    ssd1306_command(0); // Page start address (0 = reset)
-#if SSD1306_LCDHEIGHT == 64
-    ssd1306_command(7); // Page end address
-#endif
-#if SSD1306_LCDHEIGHT == 32
-    ssd1306_command(3); // Page end address
-#endif
-#if SSD1306_LCDHEIGHT == 16
-    ssd1306_command(1); // Page end address
-#endif
+static unsigned char ssd1306_reverse(unsigned char b)
+{
+    b = (unsigned char)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+    b = (unsigned char)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+    return (unsigned char)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+}
 
-    // I2C
-    for (int i = 0; i < (SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8); i += 8)
+// Rotate the drawing area into the panel layout of turned
+static void ssd1306_turn(void)
+{
+    unsigned int const W = geo->width, P = geo->pages, H = geo->height;
+    unsigned char in[8], out[8];
+    if (rotation == 2)
     {
-        struct i2c_msg messages;
-        struct i2c_rdwr_ioctl_data data;
-        unsigned char msg_buf[1 + 8] = {0x40};
-        memcpy(msg_buf + 1, buffer + i, 8);
+        for (unsigned int p = 0; p < P; ++p)
+        {
+            unsigned char const *src = buffer + (P - 1 - p) * W + W - 1;
+            for (unsigned int x = 0; x < W; ++x)
+            {
+                turned[p * W + x] = ssd1306_reverse(*src--);
+            }
+        }
+        return;
+    }
+    // the drawing area is H wide and W tall, each of its pages becomes 8 panel columns
+    for (unsigned int q = 0; q < W / 8; ++q)
+    {
+        unsigned char const *src = buffer + q * H;
+        for (unsigned int p = 0; p < P; ++p)
+        {
+            for (unsigned int k = 0; k < 8; ++k)
+            {
+                // 90 degrees puts drawing column 8p+k on panel row 8p+k, 270 on row H-1-(8p+k)
+                in[k] = rotation == 1 ? src[8 * p + k] : src[H - 1 - 8 * p - k];
+            }
+            ssd1306_transpose(in, out);
+            for (unsigned int b = 0; b < 8; ++b)
+            {
+                // drawing row 8q+b lands on panel column W-1-(8q+b) at 90 degrees, 8q+b at 270
+                turned[p * W + (rotation == 1 ? W - 1 - 8 * q - b : 8 * q + b)] = out[b];
+            }
+        }
+    }
+}
 
-        messages.addr = SSD1306_I2C_ADDRESS;
-        messages.flags = 0;
-        messages.len = sizeof(msg_buf);
-        messages.buf = msg_buf;
-        data.msgs = &messages;
-        data.nmsgs = 1;
+void ssd1306_display(void)
+{
+    ++stat.frames;
+    // the previous frame is still on its way, the back buffer keeps its changes for the next call
+    if (atomic_load_explicit(&front.pending, memory_order_acquire))
+    {
+        ++stat.deferred;
+        return;
+    }
+    if (atomic_exchange_explicit(&front.failed, false, memory_order_relaxed))
+    {
+        // the RAM pointer is lost, resend the whole frame in smaller pieces
+        unsigned int n = ssd1306_getChunk();
+        chunk = n / 2 > SSD1306_CHUNK_MIN ? n / 2 : SSD1306_CHUNK_MIN;
+        streak = 0;
+        ssd1306_invalidate();
+    }
+    else if (flushed && chunk < chunk_set && ++streak >= SSD1306_CHUNK_REGROW)
+    {
+        // the trouble may have been a passing one, try longer messages again
+        chunk = chunk * 2 < chunk_set ? chunk * 2 : chunk_set;
+        streak = 0;
+    }
+    flushed = false;
+    unsigned char const *back = buffer;
+    if (rotation & 1 || (rotation == 2 && !driver->commands))
+    {
+        // the drawing area does not map onto panel pages, so rotate all of it and let the trim find the changes
+        unsigned int p = 0;
+        while (p < SSD1306_CANVAS_PAGES && dirty.lo[p] > dirty.hi[p])
+        {
+            ++p;
+        }
+        if (p < SSD1306_CANVAS_PAGES)
+        {
+            ssd1306_turn();
+            memset(dirty.lo, 0x00, geo->pages);
+            memset(dirty.hi, geo->width - 1, geo->pages);
+            memset(dirty.lo + geo->pages, 0xFF, SSD1306_CANVAS_PAGES - geo->pages);
+        }
+        back = turned;
+    }
+    if (synced)
+    {
+        geo->trim(back);
+    }
+    unsigned int p = 0;
+    while (p < geo->pages && dirty.lo[p] > dirty.hi[p])
+    {
+        ++p;
+    }
+    if (p == geo->pages)
+    {
+        ++stat.skipped;
+        return;
+    }
+    // the next tick redraws anyway, so a refused frame is simply skipped
+    if (driver->addr && !i2c_budget_ok(driver->addr))
+    {
+        return;
+    }
+    for (; p < geo->pages; ++p)
+    {
+        if (dirty.lo[p] <= dirty.hi[p])
+        {
+            unsigned int at = p * geo->width + dirty.lo[p];
+            memcpy(front_buf + at, back + at, dirty.hi[p] - dirty.lo[p] + 1U);
+            stat.bytes += dirty.hi[p] - dirty.lo[p] + 1U;
+        }
+    }
+    front.nmsgs = 0;
+    front.ncmds = 0;
+    driver->flush(front_buf, dirty.lo, dirty.hi);
+    ssd1306_clean();
+    synced = true;
+
+    // hand the frame to the bus thread, or send it right here when there is none
+    flushed = true;
+    atomic_store_explicit(&front.pending, front.nmsgs, memory_order_relaxed);
+    ssd1306_prefix(0);
+    for (unsigned int i = 0; i < front.nmsgs; ++i)
+    {
+        i2c_submit(i2cd, front.msgs + i, 1, ssd1306_sent, (void *)(uintptr_t)i);
+    }
+}
 
-        ioctl(i2cd, I2C_RDWR, &data);
-        usleep(1000);
+static void ssd1306_i2c_flush(unsigned char *buf, unsigned char const *lo, unsigned char const *hi)
+{
+    (void)(buf);
+    // grow a window over consecutive dirty pages while that costs less than setting up another
+    unsigned int x0 = 0, x1 = 0, p0 = 0, n = 0;
+    for (unsigned int p = 0; p < geo->pages; ++p)
+    {
+        if (lo[p] > hi[p])
+        {
+            if (n)
+            {
+                ssd1306_window(x0, x1, p0, p0 + n - 1);
+                n = 0;
+            }
+            continue;
+        }
+        if (n)
+        {
+            unsigned int l = lo[p] < x0 ? lo[p] : x0;
+            unsigned int h = hi[p] > x1 ? hi[p] : x1;
+            unsigned int apart = n * (x1 - x0 + 1) + (hi[p] - lo[p] + 1) + SSD1306_WINDOW_COST;
+            if ((n + 1) * (h - l + 1) <= apart)
+            {
+                x0 = l;
+                x1 = h;
+                ++n;
+                continue;
+            }
+            ssd1306_window(x0, x1, p0, p0 + n - 1);
+        }
+        x0 = lo[p];
+        x1 = hi[p];
+        p0 = p;
+        n = 1;
+    }
+    if (n)
+    {
+        ssd1306_window(x0, x1, p0, p0 + n - 1);
     }
 }
 
@@ -388,14 +805,11 @@ void ssd1306_display(void)
 // ssd1306_startscrollright(0x00, 0x0F)
 void ssd1306_startscrollright(unsigned int start, unsigned int stop)
 {
-    ssd1306_command(SSD1306_RIGHT_HORIZONTAL_SCROLL);
-    ssd1306_command(0x00);
-    ssd1306_command(start);
-    ssd1306_command(0x00);
-    ssd1306_command(stop);
-    ssd1306_command(0x00);
-    ssd1306_command(0xFF);
-    ssd1306_command(SSD1306_ACTIVATE_SCROLL);
+    unsigned char const scroll[] = {
+        SSD1306_RIGHT_HORIZONTAL_SCROLL, 0x00, (unsigned char)start, 0x00, (unsigned char)stop, 0x00, 0xFF,
+        SSD1306_ACTIVATE_SCROLL,
+    };
+    ssd1306_commands(scroll, sizeof(scroll));
 }
 
 // startscrollleft
@@ -404,14 +818,11 @@ void ssd1306_startscrollright(unsigned int start, unsigned int stop)
 // ssd1306_startscrollleft(0x00, 0x0F)
 void ssd1306_startscrollleft(unsigned int start, unsigned int stop)
 {
-    ssd1306_command(SSD1306_LEFT_HORIZONTAL_SCROLL);
-    ssd1306_command(0x00);
-    ssd1306_command(start);
-    ssd1306_command(0x00);
-    ssd1306_command(stop);
-    ssd1306_command(0x00);
-    ssd1306_command(0xFF);
-    ssd1306_command(SSD1306_ACTIVATE_SCROLL);
+    unsigned char const scroll[] = {
+        SSD1306_LEFT_HORIZONTAL_SCROLL, 0x00, (unsigned char)start, 0x00, (unsigned char)stop, 0x00, 0xFF,
+        SSD1306_ACTIVATE_SCROLL,
+    };
+    ssd1306_commands(scroll, sizeof(scroll));
 }
 
 // startscrolldiagright
@@ -420,16 +831,12 @@ void ssd1306_startscrollleft(unsigned int start, unsigned int stop)
 // ssd1306_startscrolldiagright(0x00, 0x0F)
 void ssd1306_startscrolldiagright(unsigned int start, unsigned int stop)
 {
-    ssd1306_command(SSD1306_SET_VERTICAL_SCROLL_AREA);
-    ssd1306_command(0x00);
-    ssd1306_command(SSD1306_LCDHEIGHT);
-    ssd1306_command(SSD1306_VERTICAL_AND_RIGHT_HORIZONTAL_SCROLL);
-    ssd1306_command(0x00);
-    ssd1306_command(start);
-    ssd1306_command(0x00);
-    ssd1306_command(stop);
-    ssd1306_command(0x01);
-    ssd1306_command(SSD1306_ACTIVATE_SCROLL);
+    unsigned char const scroll[] = {
+        SSD1306_SET_VERTICAL_SCROLL_AREA, 0x00, (unsigned char)geo->height,
+        SSD1306_VERTICAL_AND_RIGHT_HORIZONTAL_SCROLL, 0x00, (unsigned char)start, 0x00, (unsigned char)stop, 0x01,
+        SSD1306_ACTIVATE_SCROLL,
+    };
+    ssd1306_commands(scroll, sizeof(scroll));
 }
 
 // startscrolldiagleft
@@ -438,16 +845,12 @@ void ssd1306_startscrolldiagright(unsigned int start, unsigned int stop)
 // ssd1306_startscrolldiagleft(0x00, 0x0F)
 void ssd1306_startscrolldiagleft(unsigned int start, unsigned int stop)
 {
-    ssd1306_command(SSD1306_SET_VERTICAL_SCROLL_AREA);
-    ssd1306_command(0x00);
-    ssd1306_command(SSD1306_LCDHEIGHT);
-    ssd1306_command(SSD1306_VERTICAL_AND_LEFT_HORIZONTAL_SCROLL);
-    ssd1306_command(0x00);
-    ssd1306_command(start);
-    ssd1306_command(0x00);
-    ssd1306_command(stop);
-    ssd1306_command(0x01);
-    ssd1306_command(SSD1306_ACTIVATE_SCROLL);
+    unsigned char const scroll[] = {
+        SSD1306_SET_VERTICAL_SCROLL_AREA, 0x00, (unsigned char)geo->height,
+        SSD1306_VERTICAL_AND_LEFT_HORIZONTAL_SCROLL, 0x00, (unsigned char)start, 0x00, (unsigned char)stop, 0x01,
+        SSD1306_ACTIVATE_SCROLL,
+    };
+    ssd1306_commands(scroll, sizeof(scroll));
 }
 
 void ssd1306_stopscroll(void) { ssd1306_command(SSD1306_DEACTIVATE_SCROLL); }
@@ -476,22 +879,62 @@ void ssd1306_dim(unsigned int dim)
     }
     // the range of contrast to too small to be really useful
     // it is useful to dim the display
-    ssd1306_command(SSD1306_SETCONTRAST);
-    ssd1306_command(contrast);
+    unsigned char const cmd[] = {SSD1306_SETCONTRAST, (unsigned char)contrast};
+    ssd1306_commands(cmd, sizeof(cmd));
 }
 
 // clear everything
+SSD1306_INLINE void ssd1306_clear(int const W, int const H)
+{
+    // only the lit span of each page changes
+    for (int p = 0; p < H / 8; ++p)
+    {
+        unsigned char const *row = buffer + p * W;
+        int lo = 0, hi = W - 1;
+        while (lo <= hi && row[lo] == 0)
+        {
+            ++lo;
+        }
+        while (hi > lo && row[hi] == 0)
+        {
+            --hi;
+        }
+        if (lo <= hi)
+        {
+            ssd1306_touch(p, lo, hi);
+        }
+    }
+    memset(buffer, 0, (W * H / 8) * sizeof(*buffer));
+}
+
 void ssd1306_clearDisplay(void)
 {
-    memset(buffer, 0, (SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8) * sizeof(*buffer));
+    canvas->clear();
     cursor_y = 0;
     cursor_x = 0;
 }
 
-void ssd1306_drawFastHLineInternal(int x, int y, int w, unsigned int color)
+// Raster operation that draws color, -1 for colors that draw nothing
+static int ssd1306_op(unsigned int color)
+{
+    switch (color)
+    {
+    case WHITE:
+        return RASTER_OR;
+    case BLACK:
+        return RASTER_CLEAR;
+    case INVERSE:
+        return RASTER_XOR;
+    default:
+        return -1;
+    }
+}
+
+SSD1306_INLINE void ssd1306_hline(int const W, int const H, int x, int y, int w, unsigned int color)
 {
+    int op = ssd1306_op(color);
     // Do bounds/limit checks
-    if (y < 0 || y >= HEIGHT)
+    if (op < 0 || y < 0 || y >= H)
     {
         return;
     }
@@ -502,320 +945,158 @@ void ssd1306_drawFastHLineInternal(int x, int y, int w, unsigned int color)
         x = 0;
     }
     // make sure we don't go off the edge of the display
-    if ((x + w) > WIDTH)
+    if ((x + w) > W)
     {
-        w = (WIDTH - x);
+        w = (W - x);
     }
     // if our width is now negative, punt
     if (w <= 0)
     {
         return;
     }
-    // set up the pointer for movement through the buffer
-    unsigned char *pBuf = (unsigned char *)buffer;
-    // adjust the buffer pointer for the current row
-    pBuf += ((y / 8) * SSD1306_LCDWIDTH);
-    // and offset x columns in
-    pBuf += x;
-
-    unsigned char mask = 1 << (y & 7);
-
-    switch (color)
-    {
-    case WHITE:
-        while (w--)
-        {
-            *pBuf++ |= mask;
-        };
-        break;
-    case BLACK:
-        mask = ~mask;
-        while (w--)
-        {
-            *pBuf++ &= mask;
-        };
-        break;
-    case INVERSE:
-        while (w--)
-        {
-            *pBuf++ ^= mask;
-        };
-        break;
-    default:
-        break;
-    }
+    ssd1306_touch(y / 8, x, x + w - 1);
+    // one bit of every column in the page, a word of columns at a time
+    raster_fill(buffer + (y / 8) * W + x, (unsigned int)w, (unsigned char)(1 << (y & 7)), (enum raster_op)op);
 }
 
-void ssd1306_drawFastVLineInternal(int x, int __y, int __h, unsigned int color)
+SSD1306_INLINE void ssd1306_vline(int const W, int const H, int x, int y, int h, unsigned int color)
 {
+    int op = ssd1306_op(color);
     // do nothing if we're off the left or right side of the screen
-    if (x < 0 || x >= WIDTH)
+    if (op < 0 || x < 0 || x >= W)
     {
         return;
     }
     // make sure we don't try to draw below 0
-    if (__y < 0)
+    if (y < 0)
     {
-        // __y is negative, this will subtract enough from __h to account
-        // for __y being 0
-        __h += __y;
-        __y = 0;
+        h += y;
+        y = 0;
     }
     // make sure we don't go past the height of the display
-    if ((__y + __h) > HEIGHT)
+    if ((y + h) > H)
     {
-        __h = (HEIGHT - __y);
+        h = (H - y);
     }
     // if our height is now negative, punt
-    if (__h <= 0)
+    if (h <= 0)
     {
         return;
     }
-    // this display doesn't need ints for coordinates, use local byte
-    // registers for faster juggling
-    unsigned int y = __y;
-    unsigned int h = __h;
-
-    // set up the pointer for fast movement through the buffer
-    unsigned char *pBuf = (unsigned char *)buffer;
-    // adjust the buffer pointer for the current row
-    pBuf += ((y / 8) * SSD1306_LCDWIDTH);
-    // and offset x columns in
-    pBuf += x;
-
-    // do the first partial byte, if necessary - this requires some
-    // masking
-    unsigned char mod = (y & 7);
-    if (mod)
-    {
-        // mask off the high n bits we want to set
-        mod = 8 - mod;
-
-        // note - lookup table results in a nearly 10% performance
-        // improvement in fill* functions
-        // register unsigned int mask = ~(0xFF >> (mod));
-        static unsigned int premask[8] = {0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE};
-        unsigned int mask = premask[mod];
-
-        // adjust the mask if we're not going to reach the end of this
-        // byte
-        if (h < mod)
-        {
-            mask &= (0xFF >> (mod - h));
-        }
-
-        switch (color)
-        {
-        case WHITE:
-            *pBuf |= mask;
-            break;
-        case BLACK:
-            *pBuf &= ~mask;
-            break;
-        case INVERSE:
-            *pBuf ^= mask;
-            break;
-        }
-
-        // fast exit if we're done here!
-        if (h < mod)
-        {
-            return;
-        }
-
-        h -= mod;
-
-        pBuf += SSD1306_LCDWIDTH;
-    }
-    // write solid bytes while we can - effectively doing 8 rows at a time
-    if (h >= 8)
+    for (int p = y / 8; p <= (y + h - 1) / 8; ++p)
     {
-        if (color == INVERSE)
-        { // separate copy of the code so we don't
-            // impact performance of the black/white
-            // write version with an extra comparison
-            // per loop
-            do
-            {
-                *pBuf = ~(*pBuf);
-
-                // adjust the buffer forward 8 rows worth of data
-                pBuf += SSD1306_LCDWIDTH;
-
-                // adjust h & y (there's got to be a faster way for me to
-                // do this, but this should still help a fair bit for now)
-                h -= 8;
-            } while (h >= 8);
-        }
-        else
-        {
-            // store a local value to work with
-            register unsigned int val = (color == WHITE) ? 255 : 0;
-            do
-            {
-                // write our value in
-                *pBuf = val;
+        ssd1306_touch(p, x, x);
+    }
+    raster_rect(buffer, W, x, y, 1, h, (enum raster_op)op);
+}
 
-                // adjust the buffer forward 8 rows worth of data
-                pBuf += SSD1306_LCDWIDTH;
+/* Specialize the kernels for each supported panel, so its size is a constant inside them */
+#define SSD1306_CANVAS(W, H)                                                     \
+    static void ssd1306_pixel_##W##x##H(int x, int y, unsigned int color)        \
+    {                                                                            \
+        ssd1306_pixel(W, H, x, y, color);                                        \
+    }                                                                            \
+    static void ssd1306_hline_##W##x##H(int x, int y, int w, unsigned int color) \
+    {                                                                            \
+        ssd1306_hline(W, H, x, y, w, color);                                     \
+    }                                                                            \
+    static void ssd1306_vline_##W##x##H(int x, int y, int h, unsigned int color) \
+    {                                                                            \
+        ssd1306_vline(W, H, x, y, h, color);                                     \
+    }                                                                            \
+    static void ssd1306_clear_##W##x##H(void) { ssd1306_clear(W, H); }
+#define SSD1306_GEOMETRY(W, H) \
+    SSD1306_CANVAS(W, H)       \
+    SSD1306_CANVAS(H, W)       \
+    static void ssd1306_trim_##W##x##H(unsigned char const *back) { ssd1306_trim(W, H, back); }
+#define SSD1306_KERNELS(W, H) \
+    {W, H, ssd1306_pixel_##W##x##H, ssd1306_hline_##W##x##H, ssd1306_vline_##W##x##H, ssd1306_clear_##W##x##H}
+
+SSD1306_GEOMETRY(128, 32)
+SSD1306_GEOMETRY(128, 64)
+SSD1306_GEOMETRY(96, 16)
+
+static struct ssd1306_geometry const geometries[] = {
+    {"128x32", 128, 32, 4, 0x02, {0x8F, 0x8F}, ssd1306_trim_128x32, SSD1306_KERNELS(128, 32), SSD1306_KERNELS(32, 128)},
+    {"128x64", 128, 64, 8, 0x12, {0xCF, 0x9F}, ssd1306_trim_128x64, SSD1306_KERNELS(128, 64), SSD1306_KERNELS(64, 128)},
+    {"96x16", 96, 16, 2, 0x02, {0xAF, 0x10}, ssd1306_trim_96x16, SSD1306_KERNELS(96, 16), SSD1306_KERNELS(16, 96)},
+};
+static struct ssd1306_geometry const *geo = geometries;
+static struct ssd1306_kernels const *canvas = &geometries[0].upright;
 
-                // adjust h & y (there's got to be a faster way for me to
-                // do this, but this should still help a fair bit for now)
-                h -= 8;
-            } while (h >= 8);
-        }
-    }
-    // now do the final partial byte, if necessary
-    if (h)
-    {
-        mod = h & 7;
-        // this time we want to mask the low bits of the byte, vs the high
-        // bits we did above
-        // register unsigned int mask = (1 << mod) - 1;
-        // note - lookup table results in a nearly 10% performance
-        // improvement in fill* functions
-        static unsigned int postmask[8] = {0x00, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F};
-        unsigned int mask = postmask[mod];
-        switch (color)
-        {
-        case WHITE:
-            *pBuf |= mask;
-            break;
-        case BLACK:
-            *pBuf &= ~mask;
-            break;
-        case INVERSE:
-            *pBuf ^= mask;
-            break;
-        default:
-            break;
-        }
-    }
+// the drawing area changes its shape, so start over from a blank one
+static void ssd1306_reshape(void)
+{
+    canvas = rotation & 1 ? &geo->turned : &geo->upright;
+    memset(buffer, 0, sizeof(buffer));
+    ssd1306_invalidate();
 }
 
-void ssd1306_drawFastHLine(int x, int y, int w, unsigned int color)
+int ssd1306_setSize(char const *name)
 {
-    unsigned int bSwap = false;
-    switch (rotation)
-    {
-    case 0:
-        // 0 degree rotation, do nothing
-        break;
-    case 1:
-        // 90 degree rotation, swap x & y for rotation, then invert x
-        bSwap = true;
-        ssd1306_swap(x, y);
-        x = WIDTH - x - 1;
-        break;
-    case 2:
-        // 180 degree rotation, invert x and y - then shift y around for
-        // height.
-        x = WIDTH - x - 1;
-        y = HEIGHT - y - 1;
-        x -= (w - 1);
-        break;
-    case 3:
-        // 270 degree rotation, swap x & y for rotation, then invert y and
-        // adjust y for w (not to become h)
-        bSwap = true;
-        ssd1306_swap(x, y);
-        y = HEIGHT - y - 1;
-        y -= (w - 1);
-        break;
-    default:
-        break;
-    }
-    if (bSwap)
-    {
-        ssd1306_drawFastVLineInternal(x, y, w, color);
-    }
-    else
+    for (unsigned int i = 0; i < sizeof(geometries) / sizeof(*geometries); ++i)
     {
-        ssd1306_drawFastHLineInternal(x, y, w, color);
+        if (strcasecmp(geometries[i].name, name) == 0)
+        {
+            geo = geometries + i;
+            ssd1306_reshape();
+            return 0;
+        }
     }
+    return ~0;
 }
 
-void ssd1306_drawFastVLine(int x, int y, int h, unsigned int color)
+char const *ssd1306_getSize(void) { return geo->name; }
+unsigned int ssd1306_width(void) { return geo->width; }
+unsigned int ssd1306_height(void) { return geo->height; }
+
+void ssd1306_setRotation(unsigned int n)
 {
-    unsigned int bSwap = false;
-    switch (rotation)
-    {
-    case 0:
-        break;
-    case 1:
-        // 90 degree rotation, swap x & y for rotation, then invert x and
-        // adjust x for h (now to become w)
-        bSwap = true;
-        ssd1306_swap(x, y);
-        x = WIDTH - x - 1;
-        x -= (h - 1);
-        break;
-    case 2:
-        // 180 degree rotation, invert x and y - then shift y around for
-        // height.
-        x = WIDTH - x - 1;
-        y = HEIGHT - y - 1;
-        y -= (h - 1);
-        break;
-    case 3:
-        // 270 degree rotation, swap x & y for rotation, then invert y
-        bSwap = true;
-        ssd1306_swap(x, y);
-        y = HEIGHT - y - 1;
-        break;
-    default:
-        break;
-    }
-    if (bSwap)
-    {
-        ssd1306_drawFastHLineInternal(x, y, h, color);
-    }
-    else
-    {
-        ssd1306_drawFastVLineInternal(x, y, h, color);
-    }
+    rotation = n & 3;
+    ssd1306_reshape();
 }
 
+unsigned int ssd1306_getRotation(void) { return rotation; }
+unsigned int ssd1306_canvasWidth(void) { return canvas->width; }
+unsigned int ssd1306_canvasHeight(void) { return canvas->height; }
+
+void ssd1306_drawPixel(int x, int y, unsigned int color) { canvas->pixel(x, y, color); }
+void ssd1306_drawFastHLine(int x, int y, int w, unsigned int color) { canvas->hline(x, y, w, color); }
+void ssd1306_drawFastVLine(int x, int y, int h, unsigned int color) { canvas->vline(x, y, h, color); }
+
 void ssd1306_fillRect(int x, int y, int w, int h, int fillcolor)
 {
-    // Bounds check
-    if ((x >= WIDTH) || (y >= HEIGHT))
+    int const W = (int)canvas->width, H = (int)canvas->height;
+    int op = ssd1306_op((unsigned int)fillcolor);
+    // clip to the canvas
+    if (x < 0)
     {
-        return;
+        w += x;
+        x = 0;
     }
-
-    // Y bounds check
-    if (y + h > HEIGHT)
+    if (y < 0)
     {
-        h = HEIGHT - y - 1;
+        h += y;
+        y = 0;
     }
-    // X bounds check
-    if (x + w > WIDTH)
+    if (x + w > W)
     {
-        w = WIDTH - x - 1;
+        w = W - x;
     }
-
-    switch (rotation)
+    if (y + h > H)
     {
-    case 1:
-        ssd1306_swap(x, y);
-        x = WIDTH - x - 1;
-        break;
-    case 2:
-        x = WIDTH - x - 1;
-        y = HEIGHT - y - 1;
-        break;
-    case 3:
-        ssd1306_swap(x, y);
-        y = HEIGHT - y - 1;
-        break;
-    default:
-        break;
+        h = H - y;
+    }
+    if (op < 0 || w <= 0 || h <= 0)
+    {
+        return;
     }
-    for (int i = 0; i < h; i++)
+    for (int p = y / 8; p <= (y + h - 1) / 8; ++p)
     {
-        ssd1306_drawFastHLine(x, y + i, w, fillcolor);
+        ssd1306_touch(p, x, x + w - 1);
     }
+    // whole pages at once instead of a line per row
+    raster_rect(buffer, W, x, y, w, h, (enum raster_op)op);
 }
 
 int textsize = 1;
@@ -838,7 +1119,7 @@ void ssd1306_write(int c)
     {
         ssd1306_drawChar(cursor_x, cursor_y, c, WHITE, textsize);
         cursor_x += textsize * 6;
-        if (wrap && (cursor_x > (WIDTH - textsize * 6)))
+        if (wrap && (cursor_x > ((int)canvas->width - textsize * 6)))
         {
             cursor_y += textsize * 8;
             cursor_x = 0;
@@ -860,6 +1141,7 @@ void ssd1306_drawText(int x, int y, char *str)
     int point_x = x;
     int point_y = y;
     int end = strlen(str);
+    int const W = (int)canvas->width;
     for (int i = 0; i < end; i++)
     {
         if (str[i] == '\n')
@@ -875,7 +1157,7 @@ void ssd1306_drawText(int x, int y, char *str)
         {
             ssd1306_drawChar(point_x, point_y, str[i], WHITE, textsize);
             point_x += textsize * 6;
-            if (wrap && (point_x > (WIDTH - textsize * 6)))
+            if (wrap && (point_x > (W - textsize * 6)))
             {
                 point_y += textsize * 8;
                 point_x = 0;
@@ -884,16 +1166,152 @@ void ssd1306_drawText(int x, int y, char *str)
     }
 }
 
+// Blit w columns by n pages of page-format bits at x,y, page-aligned rows are one byte per column, others are split over two pages
+static void ssd1306_blit(int x, int y, unsigned char const *src, int w, int n, int color)
+{
+    int const W = (int)canvas->width;
+    int const pages = (int)canvas->height / 8;
+    int const op = ssd1306_op((unsigned int)color);
+    unsigned int shift = y & 7;
+    int top = (y - (int)shift) / 8;
+    if (op < 0)
+    {
+        return;
+    }
+    for (int k = 0; k < n; ++k, src += w)
+    {
+        // the glyph is drawn transparently, so only set bits change anything
+        for (unsigned int part = 0; part < (shift ? 2U : 1U); ++part)
+        {
+            int page = top + k + (int)part;
+            if (page < 0 || page >= pages)
+            {
+                continue;
+            }
+            unsigned char *row = buffer + page * W;
+            if (shift == 0)
+            {
+                // a page-aligned row is the source bytes as they are, combined a word at a time
+                int lo = x < 0 ? 0 : x, end = x + w < W ? x + w : W;
+                if (lo < end)
+                {
+                    raster_blit(row + lo, src + (lo - x), (unsigned int)(end - lo), (enum raster_op)op);
+                    ssd1306_touch(page, lo, end - 1);
+                }
+                continue;
+            }
+            int lo = W, hi = -1;
+            for (int i = 0; i < w; ++i)
+            {
+                int col = x + i;
+                if (col < 0 || col >= W)
+                {
+                    continue;
+                }
+                unsigned char line = pgm_read_byte(src + i);
+                unsigned char bits = part ? line >> (8 - shift) : (unsigned char)(line << shift);
+                unsigned char old = row[col];
+                switch (color)
+                {
+                case WHITE:
+                    row[col] |= bits;
+                    break;
+                case BLACK:
+                    row[col] &= ~bits;
+                    break;
+                case INVERSE:
+                    row[col] ^= bits;
+                    break;
+                default:
+                    break;
+                }
+                if (row[col] != old)
+                {
+                    lo = col < lo ? col : lo;
+                    hi = col;
+                }
+            }
+            if (hi >= 0)
+            {
+                ssd1306_touch(page, lo, hi);
+            }
+        }
+    }
+}
+
+/*
+ Glyphs scaled up for text sizes 2 to SSD1306_ATLAS_SIZE, built on first use.
+ A glyph of size s is s pages of 5 * s columns, the blank spacer column is left out.
+ Glyphs that no longer fit into the pool are built into scratch each time they are drawn.
+*/
+static struct
+{
+    unsigned char pool[SSD1306_ATLAS_BYTES];
+    unsigned short at[SSD1306_ATLAS_SIZE - 1][256]; // offset + 1 into pool, 0 when not built
+    unsigned char scratch[SSD1306_ATLAS_SIZE * SSD1306_ATLAS_SIZE * 5];
+    unsigned int used;
+} atlas;
+
+static void ssd1306_scale(unsigned char *dst, unsigned char c, unsigned int size)
+{
+    unsigned int w = 5 * size;
+    for (unsigned int i = 0; i < 5; ++i)
+    {
+        unsigned int line = pgm_read_byte(font + c * 5 + i);
+        for (unsigned int k = 0; k < size; ++k)
+        {
+            // bit b of page k is row 8k+b of the scaled glyph, which is font row (8k+b)/size
+            unsigned char bits = 0;
+            for (unsigned int b = 0; b < 8; ++b)
+            {
+                bits |= (unsigned char)(((line >> ((8 * k + b) / size)) & 1U) << b);
+            }
+            memset(dst + k * w + i * size, bits, size);
+        }
+    }
+}
+
+static unsigned char const *ssd1306_glyph(unsigned char c, unsigned int size)
+{
+    unsigned short *at = &atlas.at[size - 2][c];
+    if (*at)
+    {
+        return atlas.pool + *at - 1;
+    }
+    unsigned int num = 5 * size * size;
+    if (atlas.used + num > sizeof(atlas.pool))
+    {
+        ssd1306_scale(atlas.scratch, c, size);
+        return atlas.scratch;
+    }
+    ssd1306_scale(atlas.pool + atlas.used, c, size);
+    *at = (unsigned short)(atlas.used + 1);
+    atlas.used += num;
+    stat.atlas = atlas.used;
+    ++stat.glyphs;
+    return atlas.pool + atlas.used - num;
+}
+
 // Draw a character
 void ssd1306_drawChar(int x, int y, unsigned char c, int color, int size)
 {
-    if ((x >= WIDTH) || // Clip right
-        (y >= HEIGHT) || // Clip bottom
+    if ((x >= (int)canvas->width) || // Clip right
+        (y >= (int)canvas->height) || // Clip bottom
         ((x + 6 * size - 1) < 0) || // Clip left
         ((y + 8 * size - 1) < 0)) // Clip top
     {
         return;
     }
+    if (size == 1)
+    {
+        ssd1306_blit(x, y, font + c * 5, 5, 1, color);
+        return;
+    }
+    if (size >= 2 && size <= SSD1306_ATLAS_SIZE)
+    {
+        ssd1306_blit(x, y, ssd1306_glyph(c, (unsigned int)size), 5 * size, size, color);
+        return;
+    }
     for (int i = 0; i < 6; i++)
     {
         int line;
@@ -39,55 +39,26 @@ All text above, and the splash screen must be included in any redistribution
     SSD1306 Displays
     -----------------------------------------------------------------------
     The driver is used in multiple displays (128x64, 128x32, etc.).
-    Select the appropriate display below to create an appropriately
-    sized framebuffer, etc.
+    Select the appropriate display at runtime with ssd1306_setSize(),
+    the framebuffer is sized for the largest one.
 
-    SSD1306_128_64  128x64 pixel display
+    128x64  128x64 pixel display
 
-    SSD1306_128_32  128x32 pixel display
+    128x32  128x32 pixel display
 
-    SSD1306_96_16
+    96x16
 
     -----------------------------------------------------------------------*/
-// #define SSD1306_128_64
-#define SSD1306_128_32
-//   #define SSD1306_96_16
+#define SSD1306_LCDWIDTH_MAX 128
+#define SSD1306_LCDHEIGHT_MAX 64
+#define SSD1306_FRAME_MAX (SSD1306_LCDWIDTH_MAX * SSD1306_LCDHEIGHT_MAX / 8)
 /*=========================================================================*/
 
-#if defined SSD1306_128_32
-#define WIDTH 128
-#define HEIGHT 32
-#endif
-
-#if defined SSD1306_128_64
-#define WIDTH 128
-#define HEIGHT 64
-#endif
-
-#if defined SSD1306_96_16
-#define WIDTH 96
-#define HEIGHT 16
-#endif
-
-#if defined SSD1306_128_64 && defined SSD1306_128_32
-#error "Only one SSD1306 display can be specified at once in SSD1306.h"
-#endif
-#if !defined SSD1306_128_64 && !defined SSD1306_128_32 && !defined SSD1306_96_16
-#error "At least one SSD1306 display must be specified in SSD1306.h"
-#endif
-
-#if defined SSD1306_128_64
-#define SSD1306_LCDWIDTH 128
-#define SSD1306_LCDHEIGHT 64
-#endif
-#if defined SSD1306_128_32
-#define SSD1306_LCDWIDTH 128
-#define SSD1306_LCDHEIGHT 32
-#endif
-#if defined SSD1306_96_16
-#define SSD1306_LCDWIDTH 96
-#define SSD1306_LCDHEIGHT 16
-#endif
+#define SSD1306_LCDWIDTH ssd1306_width()
+#define SSD1306_LCDHEIGHT ssd1306_height()
+// drawing area, which is the panel turned by the rotation
+#define WIDTH ((int)ssd1306_canvasWidth())
+#define HEIGHT ((int)ssd1306_canvasHeight())
 
 #define SSD1306_SETCONTRAST 0x81
 #define SSD1306_DISPLAYALLON_RESUME 0xA4
@@ -123,6 +94,12 @@ All text above, and the splash screen must be included in any redistribution
 
 #define SSD1306_CHARGEPUMP 0x8D
 
+#define SSD1306_NOP 0xE3
+
+// Largest text size drawn from prescaled glyphs, and the memory they may take
+#define SSD1306_ATLAS_SIZE 4
+#define SSD1306_ATLAS_BYTES 8192
+
 #define SSD1306_EXTERNALVCC 0x1
 #define SSD1306_SWITCHCAPVCC 0x2
 
@@ -135,12 +112,61 @@ All text above, and the splash screen must be included in any redistribution
 #define SSD1306_VERTICAL_AND_RIGHT_HORIZONTAL_SCROLL 0x29
 #define SSD1306_VERTICAL_AND_LEFT_HORIZONTAL_SCROLL 0x2A
 
+struct ssd1306_stat
+{
+    unsigned long frames; // calls to ssd1306_display
+    unsigned long skipped; // frames identical to what the panel shows
+    unsigned long deferred; // frames held back while the previous one was still being sent
+    unsigned long bytes; // changed framebuffer bytes flushed
+    unsigned long glyphs; // scaled glyphs kept in the atlas
+    unsigned long atlas; // atlas bytes in use, at most SSD1306_ATLAS_BYTES
+};
+
+/* Backend that brings the page-format framebuffer to the panel */
+struct ssd1306_driver
+{
+    char const *name;
+    unsigned char addr; // I2C address, 0 when the kernel drives the panel
+    int (*open)(char const *path); // NULL when there is nothing to open
+    void (*init)(unsigned int vccstate); // NULL when the panel is set up elsewhere
+    void (*commands)(unsigned char const *c, unsigned int n); // NULL without a command channel
+    /* Update columns lo[p]..hi[p] of every page p with lo[p] <= hi[p] from buf */
+    void (*flush)(unsigned char *buf, unsigned char const *lo, unsigned char const *hi);
+    void (*close)(void);
+};
+extern struct ssd1306_driver const ssd1306_driver_i2c;
+
+// Select the panel by its size such as "128x32", return ~0 for sizes without kernels
+int ssd1306_setSize(char const *name);
+char const *ssd1306_getSize(void);
+unsigned int ssd1306_width(void);
+unsigned int ssd1306_height(void);
+// Turn the picture by n quarter turns clockwise, before ssd1306_begin, this clears the framebuffer
+void ssd1306_setRotation(unsigned int n);
+unsigned int ssd1306_getRotation(void);
+unsigned int ssd1306_canvasWidth(void);
+unsigned int ssd1306_canvasHeight(void);
+
 void ssd1306_begin(unsigned int switchvcc); // switchvcc should be SSD1306_SWITCHCAPVCC
 void ssd1306_command(unsigned char c);
+void ssd1306_commands(unsigned char const *c, unsigned int n); // a whole command sequence in one transfer
 
 void ssd1306_clearDisplay(void);
+void ssd1306_invalidate(void); // send the whole framebuffer on the next display
 void ssd1306_invertDisplay(unsigned int i);
+// Hand the changes since the last call to the I2C bus thread, drawing may go on meanwhile
 void ssd1306_display(void);
+// Payload bytes per data transfer, 0 sends a whole frame at once, at least 8, halved automatically on errors
+void ssd1306_setChunk(unsigned int n);
+unsigned int ssd1306_getChunk(void);
+void ssd1306_getStat(struct ssd1306_stat *ctx);
+// Transfers of the frame being flushed, for I2C drivers, at most one command sequence per page
+#define SSD1306_STAGE_CMDS 6
+void ssd1306_stageCommands(unsigned char const *c, unsigned int n); // n <= SSD1306_STAGE_CMDS
+void ssd1306_stageData(unsigned char *data, unsigned int n); // data[-1] is borrowed for the control byte
+// Switch to the backend called name, opening path for it, return ~0 and keep the current one on failure
+int ssd1306_setDriver(char const *name, char const *path);
+struct ssd1306_driver const *ssd1306_getDriver(void);
 
 void ssd1306_startscrollright(unsigned int start, unsigned int stop);
 void ssd1306_startscrollleft(unsigned int start, unsigned int stop);
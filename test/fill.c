@@ -0,0 +1,76 @@
+/*
+ Fill random rectangles over a random picture, clipped at every edge of the canvas, and check that
+ ssd1306_fillRect leaves the framebuffer as a loop of single pixels does, for every colour.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ssd1306_i2c.h"
+#include "i2c_sim.h"
+#include "i2c.h"
+
+extern unsigned char buffer[];
+extern int i2cd;
+
+static unsigned char saved[SSD1306_FRAME_MAX];
+static unsigned char drawn[SSD1306_FRAME_MAX];
+
+static void reference(int x, int y, int w, int h, int color)
+{
+    for (int v = 0; v < h; v++)
+    {
+        for (int u = 0; u < w; u++)
+        {
+            ssd1306_drawPixel(x + u, y + v, (unsigned int)color);
+        }
+    }
+}
+
+static unsigned int run(char const *size, unsigned int rotation)
+{
+    unsigned int bad = 0;
+    ssd1306_setSize(size);
+    ssd1306_setRotation(rotation);
+    i2cd = i2c_open("sim");
+    ssd1306_begin(SSD1306_SWITCHCAPVCC);
+    srand(rotation + 1);
+    for (unsigned int i = 0; i < 5000; ++i)
+    {
+        int W = WIDTH, H = HEIGHT;
+        // corners well outside the canvas and empty or negative sizes as well
+        int x = rand() % (W + 40) - 20, y = rand() % (H + 40) - 20;
+        int w = rand() % (W + 20) - 4, h = rand() % (H + 20) - 4;
+        // WHITE, BLACK, INVERSE, and a colour that draws nothing
+        int color = rand() % 4;
+        for (unsigned int k = 0; k < sizeof(saved); ++k)
+        {
+            saved[k] = (unsigned char)rand();
+        }
+        memcpy(buffer, saved, sizeof(saved));
+        ssd1306_fillRect(x, y, w, h, color);
+        memcpy(drawn, buffer, sizeof(drawn));
+        memcpy(buffer, saved, sizeof(saved));
+        reference(x, y, w, h, color);
+        bad += memcmp(drawn, buffer, sizeof(drawn)) != 0;
+    }
+    i2c_close(i2cd);
+    printf("%s %u: canvas=%ux%u bad=%u\n", size, 90 * rotation,
+           ssd1306_canvasWidth(), ssd1306_canvasHeight(), bad);
+    return bad;
+}
+
+int main(void)
+{
+    static char const *const sizes[] = {"128x32", "128x64", "96x16"};
+    unsigned int bad = 0;
+    i2c_bus_use(&i2c_bus_sim);
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s)
+    {
+        for (unsigned int r = 0; r < 4; ++r)
+        {
+            bad += run(sizes[s], r);
+        }
+    }
+    return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/*
+ Draw at random on a turned canvas and check what each driver puts on the panel against a model,
+ for every panel size, driver and rotation. The picture is compared with the simulated panel RAM,
+ or with the file behind the fbdev driver.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ssd1306_i2c.h"
+#include "sh1106_i2c.h"
+#include "i2c_sim.h"
+#include "i2c.h"
+
+extern int i2cd;
+
+static unsigned char model[SSD1306_LCDWIDTH_MAX][SSD1306_LCDWIDTH_MAX]; // [y][x] of the canvas
+
+static void model_put(int x, int y, unsigned int color)
+{
+    if (x < 0 || y < 0 || x >= WIDTH || y >= HEIGHT)
+    {
+        return;
+    }
+    switch (color)
+    {
+    case WHITE:
+        model[y][x] = 1;
+        break;
+    case BLACK:
+        model[y][x] = 0;
+        break;
+    case INVERSE:
+        model[y][x] ^= 1;
+        break;
+    }
+}
+
+static unsigned char file[SSD1306_FRAME_MAX]; // rows of the fbdev file, least significant bit first
+
+/* Pixel x,y of the panel, fb is the file of the fbdev driver or -1 */
+static unsigned int panel(int fb, int sh1106, unsigned int x, unsigned int y)
+{
+    if (fb >= 0)
+    {
+        return (file[y * (ssd1306_width() / 8) + x / 8] >> (x & 7)) & 1U;
+    }
+    x += sh1106 ? SH1106_OFFSET : 0;
+    return (i2c_sim()->oled.ram[y / 8][x] >> (y & 7)) & 1U;
+}
+
+static unsigned int check(int fb, int sh1106)
+{
+    unsigned int W = ssd1306_width(), H = ssd1306_height();
+    // I2C controllers turn by 180 degrees themselves, so their RAM holds the canvas as drawn
+    unsigned int rotation = fb < 0 && ssd1306_getRotation() == 2 ? 0 : ssd1306_getRotation();
+    unsigned int bad = 0;
+    if (fb >= 0 && pread(fb, file, W / 8 * H, 0) != (ssize_t)(W / 8 * H))
+    {
+        return 1;
+    }
+    for (unsigned int y = 0; y < H; ++y)
+    {
+        for (unsigned int x = 0; x < W; ++x)
+        {
+            unsigned int cx, cy;
+            switch (rotation)
+            {
+            case 1:
+                cx = y;
+                cy = W - 1 - x;
+                break;
+            case 2:
+                cx = W - 1 - x;
+                cy = H - 1 - y;
+                break;
+            case 3:
+                cx = H - 1 - y;
+                cy = x;
+                break;
+            default:
+                cx = x;
+                cy = y;
+                break;
+            }
+            bad += panel(fb, sh1106, x, y) != model[cy][cx];
+        }
+    }
+    return bad;
+}
+
+static unsigned int run(char const *size, char const *driver, char const *path, unsigned int rotation)
+{
+    int sh1106 = strcmp(driver, "sh1106") == 0;
+    int fb = -1;
+    unsigned int bad = 0;
+
+    i2c_sim_sh1106(sh1106);
+    i2cd = i2c_open("sim");
+    ssd1306_setSize(size);
+    // the fbdev driver sizes the file to the panel, starting from an empty one
+    if (truncate(path, 0) || ssd1306_setDriver(driver, path))
+    {
+        printf("%s %s: cannot open\n", size, driver);
+        return 1;
+    }
+    if (strcmp(driver, "fbdev") == 0 && (fb = open(path, O_RDONLY)) < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    ssd1306_setRotation(rotation);
+    memset(model, 0, sizeof(model));
+    ssd1306_begin(SSD1306_SWITCHCAPVCC);
+    srand(rotation + 1);
+    for (unsigned int i = 0; i < 3000; ++i)
+    {
+        int x = rand() % (WIDTH + 12) - 6, y = rand() % (HEIGHT + 8) - 4, n = rand() % 60;
+        unsigned int color = (unsigned int)(rand() % 3);
+        switch (rand() % 10)
+        {
+        case 0:
+            ssd1306_clearDisplay();
+            memset(model, 0, sizeof(model));
+            break;
+        case 1:
+        case 2:
+        case 3:
+            ssd1306_drawPixel(x, y, color);
+            model_put(x, y, color);
+            break;
+        case 4:
+        case 5:
+        case 6:
+            ssd1306_drawFastHLine(x, y, n, color);
+            for (int k = 0; k < n; ++k)
+            {
+                model_put(x + k, y, color);
+            }
+            break;
+        default:
+            ssd1306_drawFastVLine(x, y, n, color);
+            for (int k = 0; k < n; ++k)
+            {
+                model_put(x, y + k, color);
+            }
+            break;
+        }
+        if (rand() % 3 == 0)
+        {
+            ssd1306_display();
+            bad += check(fb, sh1106);
+        }
+    }
+    ssd1306_display();
+    bad += check(fb, sh1106);
+    if (fb < 0)
+    {
+        // a mirrored segment and COM scan is how 180 degrees is done, anything else stays upright
+        struct i2c_sim const *sim = i2c_sim();
+        bad += sim->oled.remap != (rotation != 2) || sim->oled.comdec != (rotation != 2);
+    }
+    else
+    {
+        close(fb);
+    }
+    i2c_close(i2cd);
+    printf("%s %s %u: canvas=%ux%u bad=%u\n", size, driver, 90 * rotation,
+           ssd1306_canvasWidth(), ssd1306_canvasHeight(), bad);
+    return bad;
+}
+
+int main(void)
+{
+    static char const *const sizes[] = {"128x32", "128x64", "96x16"};
+    static char const *const drivers[] = {"ssd1306", "sh1106", "fbdev"};
+    char path[] = "/tmp/yahboom-fb-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    i2c_bus_use(&i2c_bus_sim);
+    unsigned int bad = 0;
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s)
+    {
+        for (unsigned int d = 0; d < sizeof(drivers) / sizeof(*drivers); ++d)
+        {
+            for (unsigned int r = 0; r < 4; ++r)
+            {
+                bad += run(sizes[s], drivers[d], path, r);
+            }
+        }
+    }
+    ssd1306_setDriver("ssd1306", NULL);
+    unlink(path);
+    return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
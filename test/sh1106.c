@@ -0,0 +1,90 @@
+/*
+ Draw at random through the SH1106 driver and check that the simulated panel RAM follows the framebuffer,
+ centred in the 132 columns of the controller with the edge columns left alone.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ssd1306_i2c.h"
+#include "sh1106_i2c.h"
+#include "i2c_sim.h"
+#include "i2c.h"
+
+extern unsigned char buffer[];
+extern int i2cd;
+
+static unsigned int check(void)
+{
+    struct i2c_sim const *sim = i2c_sim();
+    unsigned int bad = 0;
+    for (unsigned int p = 0; p < SSD1306_LCDHEIGHT / 8; ++p)
+    {
+        unsigned char const *ram = sim->oled.ram[p];
+        bad += memcmp(ram + SH1106_OFFSET, buffer + p * SSD1306_LCDWIDTH, SSD1306_LCDWIDTH) != 0;
+        for (unsigned int x = 0; x < SH1106_COLUMNS; ++x)
+        {
+            if (x < SH1106_OFFSET || x >= SH1106_OFFSET + SSD1306_LCDWIDTH)
+            {
+                bad += ram[x] != 0;
+            }
+        }
+    }
+    return bad;
+}
+
+static unsigned int run(char const *size)
+{
+    char text[16];
+    unsigned int bad = 0;
+    ssd1306_setSize(size);
+    i2cd = i2c_open("sim");
+    ssd1306_begin(SSD1306_SWITCHCAPVCC);
+    srand(1);
+    for (unsigned int i = 0; i < 2000; ++i)
+    {
+        int w = WIDTH, h = HEIGHT, color = rand() % 3;
+        switch (rand() % 5)
+        {
+        case 0:
+            ssd1306_clearDisplay();
+            break;
+        case 1:
+            ssd1306_drawPixel(rand() % (w + 12) - 6, rand() % (h + 8) - 4, (unsigned int)color);
+            break;
+        case 2:
+            ssd1306_fillRect(rand() % w, rand() % h, rand() % 40, rand() % 20, color);
+            break;
+        case 3:
+            sprintf(text, "%d", rand());
+            ssd1306_drawText(rand() % w, rand() % h, text);
+            break;
+        default:
+            ssd1306_drawFastVLine(rand() % w, rand() % (h + 8) - 4, rand() % 30, (unsigned int)color);
+            break;
+        }
+        if (rand() % 3 == 0)
+        {
+            ssd1306_display();
+            bad += check();
+        }
+    }
+    ssd1306_display();
+    bad += check();
+    i2c_close(i2cd);
+    printf("%s: bad=%u\n", size, bad);
+    return bad;
+}
+
+int main(void)
+{
+    i2c_bus_use(&i2c_bus_sim);
+    i2c_sim_sh1106(1);
+    if (ssd1306_setDriver("sh1106", NULL))
+    {
+        return EXIT_FAILURE;
+    }
+    unsigned int bad = run("128x64");
+    bad += run("128x32");
+    return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+/*
+ Draw random glyphs over a random picture, clipped at every edge of the canvas, and check that
+ ssd1306_drawChar leaves the framebuffer as the old loop of single pixels from the font did.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ssd1306_i2c.h"
+#include "oled_fonts.h"
+#include "i2c_sim.h"
+#include "i2c.h"
+
+extern unsigned char buffer[];
+extern int i2cd;
+
+static unsigned char saved[SSD1306_FRAME_MAX];
+static unsigned char drawn[SSD1306_FRAME_MAX];
+
+/* 6x8 cells with the last column blank, each set bit of the font a size x size square */
+static void reference(int x, int y, unsigned char c, int color, int size)
+{
+    for (int i = 0; i < 5; i++)
+    {
+        unsigned char line = font[c * 5 + i];
+        for (int j = 0; j < 8; j++, line >>= 1)
+        {
+            if (!(line & 0x1))
+            {
+                continue;
+            }
+            for (int v = 0; v < size; v++)
+            {
+                for (int u = 0; u < size; u++)
+                {
+                    ssd1306_drawPixel(x + i * size + u, y + j * size + v, (unsigned int)color);
+                }
+            }
+        }
+    }
+}
+
+static unsigned int run(char const *size, unsigned int rotation, int textsize)
+{
+    unsigned int bad = 0;
+    ssd1306_setSize(size);
+    ssd1306_setRotation(rotation);
+    i2cd = i2c_open("sim");
+    ssd1306_begin(SSD1306_SWITCHCAPVCC);
+    srand(rotation * 8 + (unsigned int)textsize);
+    for (unsigned int i = 0; i < 2000; ++i)
+    {
+        int w = WIDTH, h = HEIGHT, cw = 6 * textsize, ch = 8 * textsize;
+        int x = rand() % (w + cw + 4) - cw - 2, y = rand() % (h + ch + 4) - ch - 2;
+        int color = rand() % 3;
+        // the font holds 255 glyphs
+        unsigned char c = (unsigned char)(rand() % 255);
+        for (unsigned int k = 0; k < sizeof(saved); ++k)
+        {
+            saved[k] = (unsigned char)rand();
+        }
+        memcpy(buffer, saved, sizeof(saved));
+        ssd1306_drawChar(x, y, c, color, textsize);
+        memcpy(drawn, buffer, sizeof(drawn));
+        memcpy(buffer, saved, sizeof(saved));
+        reference(x, y, c, color, textsize);
+        bad += memcmp(drawn, buffer, sizeof(drawn)) != 0;
+    }
+    i2c_close(i2cd);
+    printf("%s %u size %d: canvas=%ux%u bad=%u\n", size, 90 * rotation, textsize,
+           ssd1306_canvasWidth(), ssd1306_canvasHeight(), bad);
+    return bad;
+}
+
+int main(void)
+{
+    static char const *const sizes[] = {"128x32", "128x64", "96x16"};
+    // from nothing drawn at 0 up to one past the atlas, where drawChar falls back to a rectangle per font bit
+    static int const textsizes[] = {0, 1, 2, 3, 4, SSD1306_ATLAS_SIZE + 1};
+    unsigned int bad = 0;
+    i2c_bus_use(&i2c_bus_sim);
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s)
+    {
+        for (unsigned int r = 0; r < 4; ++r)
+        {
+            for (unsigned int t = 0; t < sizeof(textsizes) / sizeof(*textsizes); ++t)
+            {
+                bad += run(sizes[s], r, textsizes[t]);
+            }
+        }
+    }
+    return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}